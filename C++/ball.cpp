@@ -5,91 +5,100 @@ namespace z {
 	Ball::Ball(int ballDia, int ballDensity) {		
 		alive = true;
 		stationary = false;
+		asleep = false;
+		fixed = false;
+		restSteps = 0;
 		x = y = xVel = yVel = 0;
 				
 		setSize(ballDia);
 		setMass(ballDensity);
 		
 		quadResidence = NULL;
+		sortSlack = -1.0; // Force first sort
 		
 		id = 0;
 		setID();
 	}
 
+	// Move by one step, leaving the open boundaries is up to the integrator
 	void Ball::update() {
 		if (alive) {
+			const scalar dt = *tickTime;
 			if (stationary) {
-				xVel = DRAG_FILT*(xMove - x);
-				yVel = DRAG_FILT*(yMove - y);
-				x += xVel*(*tickTime);
-				y += yVel*(*tickTime);
-				ballShape.setPosition(x - radius, y - radius);
+				xVel = scalar(DRAG_FILT)*(xMove - x);
+				yVel = scalar(DRAG_FILT)*(yMove - y);
+				x += xVel*dt;
+				y += yVel*dt;
 			}
 			else {
-				x += xVel*(*tickTime);
-				y += yVel*(*tickTime);
-				ballShape.setPosition(x - radius, y - radius);
+				x += xVel*dt;
+				y += yVel*dt;
 				
 				xMove = x;
 				yMove = y;
-				
-				if ((!*boundWalls && (x < -radius || x > (*resX) + radius)) ||
-						(!*boundCeiling && y < -radius) || (!*boundFloor && y > (*resY) + radius)) {
-					alive = false;
-				}
 			}
 		}
 	}
 
+	// Count resting steps after moving, falling asleep once there have been enough
+	void Ball::rest() {
+		if (xVel*xVel + yVel*yVel < scalar(SLEEP_VEL*SLEEP_VEL)) {
+			if (++restSteps >= SLEEP_STEPS) sleep();
+		}
+		else restSteps = 0;
+	}
+	
+	void Ball::sleep() {
+		asleep = true;
+		restSteps = SLEEP_STEPS;
+		xVel = yVel = 0;
+		xMove = x;
+		yMove = y;
+	}
+	
+	void Ball::wake() {
+		asleep = false;
+		restSteps = 0;
+	}
+
 	void Ball::setPosition(double xIn, double yIn){
 		x = xIn;
 		y = yIn;
 		xMove = xIn;
 		yMove = yIn;
-		ballShape.setPosition(x - radius, y - radius);
 	}
 	
 	void Ball::setSize(int diaClass){
-		diaClass = constrain(diaClass, 0, 2);
-		this->diameter = diameterTable[diaClass];
-		
-		this->diameterClass = diaClass;
-		
-		this->radius = diameter/2.0;
-		ballShape.setRadius(radius);
+		diaClass = constrain(diaClass, 0, DIAMETER_CLASSES - 1);
+		materialClass = materialOf(diaClass, 0);
+		radius = material().radius;
 	}
 	
+	// Call after setSize
 	void Ball::setMass(int densClass) {
-		densClass = constrain(densClass, 0, 2);
-		
-		this->densityClass = densClass;
-		
-		double area = 3.14159265359*pow(radius, 2.0);
-		mass = area*(densityTable[densClass]/78.54);
-		springRate = BASE_SPR_RATE*densityTable[densClass];
-		reboundEfficiency = DEFAULT_REB_EFF;
-		
-		// Convert to center attr rate for physics
-		attrRate = BASE_ATTR_RATE*pow(radius, 2.0)*densityTable[densClass]; 
-		attrRad = DEFAULT_ATTR_RAD;
+		densClass = constrain(densClass, 0, DENSITY_CLASSES - 1);
+		materialClass = materialOf(diameterClass(), densClass);
+		setReach();
 		
 		switch (densClass) {
 			case 0:
-				ballShape.setFillColor(sf::Color(255, 255, 255));
+				fillColor = sf::Color(255, 255, 255);
 				break;
 			case 1:
-				ballShape.setFillColor(sf::Color(127, 127, 127));
+				fillColor = sf::Color(127, 127, 127);
 				break;
 			case 2:
-				ballShape.setFillColor(sf::Color(0, 0, 0));
+				fillColor = sf::Color(0, 0, 0);
 				break;
 		}
-		ballShape.setOutlineThickness(-int(radius*0.4));
-		ballShape.setOutlineColor(sf::Color(rand()%255, rand()%255, rand()%255));
+		int r = rng->nextInt(255);
+		int g = rng->nextInt(255);
+		int b = rng->nextInt(255);
+		outlineColor = sf::Color(r, g, b);
 	}
 		
 	void Ball::setColor(int r, int g, int b) {
-		ballShape.setFillColor(sf::Color(r, g, b));
+		fillColor = sf::Color(r, g, b);
 	}
 	
 	void Ball::setID() {
@@ -101,24 +110,78 @@ namespace z {
 		}
 	}
 	
+	// Call again whenever stickyness changes
+	void Ball::setReach() {
+		reach = radius + ((*sticky) ? material().attrRad : 0.0);
+	}
+	
 	// Fills array with xMin, xMax, yMin, yMax of bounding box
 	void Ball::updateBounds() {
-		double dist = radius + ((*sticky) ? attrRad : 0.0);
-		xMin = x - dist;
-		xMax = x + dist;
-		yMin = y - dist;
-		yMax = y + dist;
+		xMin = x - reach;
+		xMax = x + reach;
+		yMin = y - reach;
+		yMax = y + reach;
+	}
+	
+	// Remember where the particle was sorted and how far it may travel without leaving its quad
+	void Ball::setSortSlack(scalar slack) {
+		sortX = x;
+		sortY = y;
+		sortDist = reach;
+		sortSlack = slack;
+	}
+	
+	// True if the particle may have crossed a quad edge since it was last sorted
+	bool Ball::sortNeeded() {
+		return (reach != sortDist || std::fabs(x - sortX) >= sortSlack || std::fabs(y - sortY) >= sortSlack);
 	}
 	
-	bool *Ball::boundCeiling;
-	bool *Ball::boundWalls;
-	bool *Ball::boundFloor;
 	bool *Ball::sticky;
 	double *Ball::tickTime;
 	int *Ball::resX;
 	int *Ball::resY;
+	Rng *Ball::rng;
 	
 	const double Ball::densityTable[] = {0.25, 1.0, 4.0};
 	const double Ball::diameterTable[] = {10.0, 20.0, 40.0};
+	Material Ball::materials[MATERIAL_CLASSES];
+	MaterialPair Ball::materialPairs[MATERIAL_CLASSES][MATERIAL_CLASSES];
+	
+	// Fill the material tables from the diameter and density classes, before any particle is made
+	void Ball::buildMaterials() {
+		for (unsigned int dia = 0; dia < DIAMETER_CLASSES; dia++) {
+			for (unsigned int dens = 0; dens < DENSITY_CLASSES; dens++) {
+				Material &m = materials[materialOf(dia, dens)];
+				m.radius = diameterTable[dia]/2.0;
+				m.innerRadius = m.radius - int(m.radius*0.4);
+				double area = 3.14159265359*pow(m.radius, 2.0);
+				m.mass = area*(densityTable[dens]/78.54);
+				m.invMass = 1.0/m.mass;
+				m.springRate = BASE_SPR_RATE*densityTable[dens];
+				m.reboundEfficiency = DEFAULT_REB_EFF;
+				// Convert to center attr rate for physics
+				m.attrRate = BASE_ATTR_RATE*pow(m.radius, 2.0)*densityTable[dens];
+				m.attrRad = DEFAULT_ATTR_RAD;
+			}
+		}
+		
+		for (unsigned int a = 0; a < MATERIAL_CLASSES; a++) {
+			for (unsigned int b = 0; b < MATERIAL_CLASSES; b++) {
+				const Material &ma = materials[a];
+				const Material &mb = materials[b];
+				MaterialPair &pair = materialPairs[a][b];
+				pair.centerDist = ma.radius + mb.radius;
+				pair.stiffness = std::min(ma.springRate, mb.springRate);
+				pair.reboundEfficiency = ma.reboundEfficiency;
+				pair.attrReach = pair.centerDist + std::max(ma.attrRad, mb.attrRad);
+				// Every class has the same attraction radius, so inside the reach both rates apply
+				pair.attraction = ma.attrRate + mb.attrRate;
+				pair.invMassA = ma.invMass;
+				pair.invMassB = mb.invMass;
+				pair.shareA = ma.mass/(ma.mass + mb.mass);
+				pair.shareB = mb.mass/(ma.mass + mb.mass);
+			}
+		}
+	}
 	
 }
@@ -13,52 +13,109 @@
 #define BASE_ATTR_RATE 50000.0
 #define DEFAULT_ATTR_RAD 5.0
 
+#define DIAMETER_CLASSES 3
+#define DENSITY_CLASSES 3
+#define MATERIAL_CLASSES 9 // Every diameter class with every density class
+
+#define SLEEP_VEL 10.0 // Particles slower than this are resting
+#define SLEEP_STEPS 200 // Resting steps before a particle falls asleep
+#define SLEEP_WAKE_STEPS 2 // Particles rested for fewer steps than this wake any sleeper they touch
+
 #define constrain(amt,low,high) ((amt)<(low)?(low):((amt)>(high)?(high):(amt)))
 
+#include <cmath>
+#include <algorithm>
 #include <SFML/Graphics.hpp>
 #include "quad.hpp"
+#include "rng.hpp"
+#include "scalar.hpp"
 
 namespace z {
 
 //class Quad;
 
+// Everything particles of one diameter and density class share
+struct Material {
+	scalar radius, innerRadius; // The fill is drawn to innerRadius, the outline is the ring outside it
+	scalar mass, invMass;
+	scalar springRate, reboundEfficiency;
+	scalar attrRad, attrRate;
+};
+
+// Two materials in contact, precomputed for the pair kernel
+struct MaterialPair {
+	scalar centerDist; // Sum of the radii
+	scalar stiffness; // The softer of the two springs
+	scalar reboundEfficiency; // The first particle's
+	scalar attrReach; // centerDist plus the larger attraction radius
+	scalar attraction; // Both attraction rates
+	scalar invMassA, invMassB;
+	scalar shareA, shareB; // Fraction of the pair's mass in each, for averaging momentum
+};
+
 class Ball {
 public:
 	unsigned int id; // This never changes and is unique after using the setID function
-	double x, y;
-	double xMove, yMove;
-	double xVel, yVel;
-	double diameter, radius;
-	double mass;
-	double springRate, reboundEfficiency;
-	double attrRad, attrRate;
-	double xMin, xMax, yMin, yMax;
-	sf::CircleShape ballShape;
+	unsigned int poolSlot; // Set by BallPool::create
+	scalar x, y;
+	scalar xMove, yMove;
+	scalar xVel, yVel;
+	scalar radius; // Copy of the material's, read by every tree and bounds test
+	scalar xMin, xMax, yMin, yMax;
+	scalar reach; // Radius, plus attrRad while particles are sticky
+	scalar sortX, sortY, sortDist, sortSlack; // Position and bound size when last sorted, travel allowed before resorting
+	sf::Color fillColor, outlineColor;
 	bool alive, stationary;
+	bool asleep; // Left out of every phase until something moving touches it
+	bool fixed; // Painted in place, kept in the static tree and never moved
+	unsigned char materialClass; // Diameter class*DENSITY_CLASSES + density class
+	unsigned short restSteps; // Steps this particle, and everything touching it, has been resting
 	
-	int diameterClass, densityClass;
-	
-	static bool *boundCeiling;
-	static bool *boundWalls;
-	static bool *boundFloor;
 	static bool *sticky;
 	static double *tickTime;
 	static int *resX;
 	static int *resY;
+	static Rng *rng;
 	
 	static const double densityTable[];
 	static const double diameterTable[];
+	static Material materials[MATERIAL_CLASSES];
+	static MaterialPair materialPairs[MATERIAL_CLASSES][MATERIAL_CLASSES];
+	
+	static void buildMaterials();
+	static unsigned char materialOf(int diaClass, int densClass) {
+		return diaClass*DENSITY_CLASSES + densClass;
+	}
 	
 	Quad *quadResidence;
 	
 	Ball(int, int);	
+	const Material& material() const {
+		return materials[materialClass];
+	}
+	const MaterialPair& pairWith(const Ball *other) const {
+		return materialPairs[materialClass][other->materialClass];
+	}
+	int diameterClass() const {
+		return materialClass/DENSITY_CLASSES;
+	}
+	int densityClass() const {
+		return materialClass%DENSITY_CLASSES;
+	}
+	
 	void update();
+	void rest();
+	void sleep();
+	void wake();
 	void setPosition(double, double);
 	void setSize(int);
 	void setMass(int);
 	void setColor(int, int, int);
 	void setID();
+	void setReach();
 	void updateBounds();
+	void setSortSlack(scalar);
+	bool sortNeeded();
 };
 }
 
@@ -0,0 +1,101 @@
+#ifndef BALL_POOL_HPP
+#define BALL_POOL_HPP
+
+#include <vector>
+#include <new>
+
+#include "spinlock.hpp"
+#include "ball.hpp"
+
+#define POOL_CHUNK 1024
+
+namespace z {
+
+// Refers to a ball by pool slot, only valid while the slot holds the same generation of ball
+struct BallHandle {
+	unsigned int slot;
+	unsigned int generation;
+	BallHandle() : slot(0), generation(0) {} // Generations start at 1, so this never resolves
+	BallHandle(unsigned int s, unsigned int g) : slot(s), generation(g) {}
+};
+
+// Hands out Balls from fixed size chunks so particles don't each get their own heap allocation
+// Released slots are recycled and every chunk is freed at once when the pool goes away
+class BallPool {
+private:
+	std::vector<Ball*> chunks;
+	std::vector<unsigned int> generations; // Bumped every time a slot is released
+	std::vector<unsigned int> freeList;
+	SpinLock poolLock;
+	
+	void addChunk() {
+		Ball *chunk = static_cast<Ball*>(::operator new(sizeof(Ball)*POOL_CHUNK));
+		unsigned int firstSlot = chunks.size()*POOL_CHUNK;
+		chunks.push_back(chunk);
+		generations.resize(firstSlot + POOL_CHUNK, 1);
+		// Hand out lowest addresses first
+		for (int k = POOL_CHUNK - 1; k >= 0; k--) freeList.push_back(firstSlot + k);
+	}
+	
+	Ball* slotBall(unsigned int slot) {
+		return chunks[slot/POOL_CHUNK] + slot%POOL_CHUNK;
+	}
+	
+public:
+	~BallPool() {
+		// Destroy whatever is still live, then drop the chunks
+		std::vector<bool> isFree(generations.size(), false);
+		for (unsigned int k = 0; k < freeList.size(); k++) isFree[freeList[k]] = true;
+		for (unsigned int slot = 0; slot < generations.size(); slot++) {
+			if (!isFree[slot]) slotBall(slot)->~Ball();
+		}
+		for (unsigned int c = 0; c < chunks.size(); c++) ::operator delete(chunks[c]);
+	}
+	
+	Ball* create(int ballDia, int ballDensity) {
+		poolLock.lock();
+		if (freeList.empty()) addChunk();
+		unsigned int slot = freeList.back();
+		freeList.pop_back();
+		Ball *ball = slotBall(slot);
+		poolLock.unlock();
+		new (ball) Ball(ballDia, ballDensity);
+		ball->poolSlot = slot;
+		return ball;
+	}
+	
+	// Handles stop resolving before the ball is destroyed, and the slot is only reused after
+	void release(Ball *ball) {
+		unsigned int slot = ball->poolSlot;
+		poolLock.lock();
+		generations[slot]++;
+		poolLock.unlock();
+		ball->~Ball();
+		poolLock.lock();
+		freeList.push_back(slot);
+		poolLock.unlock();
+	}
+	
+	BallHandle handle(Ball *ball) {
+		poolLock.lock();
+		BallHandle h(ball->poolSlot, generations[ball->poolSlot]);
+		poolLock.unlock();
+		return h;
+	}
+	
+	// Ball the handle refers to, or NULL if it has since been released
+	Ball* resolve(BallHandle h) {
+		Ball *ball = NULL;
+		poolLock.lock();
+		if (h.slot < generations.size() && generations[h.slot] == h.generation) ball = slotBall(h.slot);
+		poolLock.unlock();
+		return ball;
+	}
+	
+	unsigned int capacity() {
+		return chunks.size()*POOL_CHUNK;
+	}
+};
+}
+
+#endif
@@ -1,3 +1,6 @@
+#ifndef BARRIER_HPP
+#define BARRIER_HPP
+
 #include <atomic>
 
 namespace z {
@@ -39,4 +42,6 @@ public:
 		}
 	}
 };
-}
\ No newline at end of file
+}
+
+#endif
\ No newline at end of file
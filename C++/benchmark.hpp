@@ -0,0 +1,317 @@
+#ifndef BENCHMARK_HPP
+#define BENCHMARK_HPP
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include "particles.hpp"
+#include "spinlock.hpp"
+#include "barrier.hpp"
+#include "perfCounters.hpp"
+
+#define BENCH_RES_X 1500
+#define BENCH_RES_Y 900
+#define BENCH_SEED 1
+#define BENCH_PARTICLES 5000
+#define BENCH_REPEATS 5 // Best of this many runs is reported
+#define BENCH_LOCK_OPS 200000 // Per thread
+#define BENCH_BARRIER_ROUNDS 1000
+#define BENCH_OBSTACLES 50
+#define BENCH_BH 20
+#define BENCH_MOTION 3.0 // Pixels every particle moves in the heavy motion sort runs, a step at 3000 px/s
+#define BENCH_NAME_WIDTH 44
+
+namespace z {
+
+// Times the hot primitives one at a time on fixed inputs
+// Each is run BENCH_REPEATS times after an untimed setup and the fastest run is reported
+class Benchmark {
+private:
+	int resX, resY;
+	double tickTime;
+	Particles *particles;
+	PerfCounter cacheMisses;
+
+	// Fresh particles on the usual jittered lattice, the tree built from scratch
+	void makeParticles() {
+		delete particles;
+		particles = new Particles(&resX, &resY, &tickTime, 0);
+		particles->rng.seed(BENCH_SEED);
+		particles->particleCollisions = true;
+		particles->particleStickyness = false;
+		particles->boundCeiling = particles->boundWalls = particles->boundFloor = true;
+		particles->createInitBalls(BENCH_PARTICLES, 0, 1);
+	}
+
+	void measure(const std::string &name, uint64_t ops, std::function<void()> setup, std::function<void()> body) {
+		double best = -1;
+		uint64_t bestMisses = 0;
+		for (unsigned int r = 0; r < BENCH_REPEATS; r++) {
+			setup();
+			cacheMisses.start();
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			body();
+			double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+			uint64_t misses = cacheMisses.stop();
+			if (best < 0 || ns < best) {
+				best = ns;
+				bestMisses = misses;
+			}
+		}
+
+		std::cout << name;
+		for (unsigned int pad = name.size(); pad < BENCH_NAME_WIDTH; pad++) std::cout << " ";
+		std::cout << ops << "\t" << best/ops << "\t";
+		if (cacheMisses.valid()) std::cout << (double)bestMisses/ops << "\n";
+		else std::cout << "n/a\n";
+	}
+
+	// Every list gets a quarter of its length again in NULLs, scattered through it
+	void scatterNulls() {
+		std::vector<Quad*> &nodes = particles->quadNodes;
+		for (unsigned int n = 0; n < nodes.size(); n++) {
+			std::vector<Ball*> &list = nodes[n]->residentList;
+			unsigned int size = list.size();
+			for (unsigned int k = 0; k < size/4; k++) {
+				list.push_back(NULL);
+				std::swap(list.back(), list[particles->rng.nextInt(list.size())]);
+			}
+			nodes[n]->tooManyNulls = true;
+		}
+	}
+
+	void benchTree() {
+		makeParticles();
+		std::vector<Quad*> &nodes = particles->quadNodes;
+		std::vector<Ball*> &balls = particles->ballV;
+
+		measure("Quad::addParticle", balls.size(), [&]() {
+			for (unsigned int n = 0; n < nodes.size(); n++) {
+				nodes[n]->residentList.clear();
+				nodes[n]->tooManyNulls = false;
+			}
+		}, [&]() {
+			for (unsigned int i = 0; i < balls.size(); i++) particles->quadTree->addParticle(balls[i], true);
+		});
+
+		// Everything moves a bit over half a leaf, so most particles change quads
+		double shift = resX/(double)(1 << (LEVELS + 1)) + 1.0;
+		measure("Quad::sortParticle (migrate)", balls.size(), [&]() {
+			particles->cleanQuad();
+			shift = -shift;
+			for (unsigned int i = 0; i < balls.size(); i++) {
+				Ball *ball = balls[i];
+				double x = ball->x + shift;
+				if (x < ball->radius || x > resX - ball->radius) x = ball->x - shift;
+				ball->setPosition(x, ball->y);
+			}
+		}, [&]() {
+			for (unsigned int i = 0; i < balls.size(); i++) balls[i]->quadResidence->sortParticle(balls[i]);
+		});
+
+		particles->quadRebuildParticles();
+		measure("Quad::collideParticles", balls.size(), []() {}, [&]() {
+			for (unsigned int i = 0; i < balls.size(); i++) balls[i]->quadResidence->collideParticles<0>(balls[i], true);
+		});
+
+		// Neighbours in Z-order, about half of them touching
+		std::vector<std::pair<Ball*, Ball*> > pairs;
+		particles->reorderParticles();
+		for (unsigned int i = 0; i + 1 < balls.size(); i++) pairs.push_back(std::make_pair(balls[i], balls[i + 1]));
+		measure("Particles::collisonUpdate (runtime)", pairs.size()*10, []() {}, [&]() {
+			for (unsigned int r = 0; r < 10; r++) {
+				for (unsigned int k = 0; k < pairs.size(); k++) particles->collisonUpdate<KERNEL_DYNAMIC>(pairs[k].first, pairs[k].second);
+			}
+		});
+		measure("Particles::collisonUpdate (specialised)", pairs.size()*10, []() {}, [&]() {
+			for (unsigned int r = 0; r < 10; r++) {
+				for (unsigned int k = 0; k < pairs.size(); k++) particles->collisonUpdate<0>(pairs[k].first, pairs[k].second);
+			}
+		});
+
+		measure("Quad::cleanResidentList", balls.size() + balls.size()/4, [&]() {
+			particles->quadRebuildParticles();
+			scatterNulls();
+		}, [&]() {
+			particles->quadTree->cleanResidentList();
+		});
+	}
+
+	// Rebuilding the tree against trickling particles through it, on the same particles
+	// At rest almost nothing needs sorting, in heavy motion every particle has moved BENCH_MOTION
+	void benchSort() {
+		const char *scenes[] = {"rest", "motion"};
+		for (unsigned int s = 0; s < 2; s++) {
+			for (unsigned int rebuild = 0; rebuild < 2; rebuild++) {
+				std::string name = std::string(rebuild ? "Particles::quadRebuildParticles" : "Particles::sortTile") + " (" + scenes[s] + ")";
+				measure(name, BENCH_PARTICLES, [&]() {
+					makeParticles();
+					particles->quadRebuildParticles();
+					for (unsigned int i = 0; i < particles->pSize && s == 1; i++) {
+						Ball *ball = particles->ballV[i];
+						double angle = particles->randDouble(0, 6.28318530718);
+						ball->setPosition(constrain(ball->x + BENCH_MOTION*cos(angle), (double)ball->radius, resX - (double)ball->radius),
+															constrain(ball->y + BENCH_MOTION*sin(angle), (double)ball->radius, resY - (double)ball->radius));
+					}
+				}, [&]() {
+					if (rebuild) particles->quadRebuildParticles();
+					else {
+						for (unsigned int t = 0; t < particles->tiles.size(); t++) particles->sortTile(0, particles->tiles[t], true);
+						for (unsigned int k = 0; k < particles->upperNodes.size(); k++) particles->sortTile(0, particles->upperNodes[k], false);
+					}
+				});
+			}
+		}
+	}
+
+	// The same integration with settings tested per particle, then with the variant compiled for them
+	void benchKernels() {
+		const char *names[] = {"Particles::integrateSlot (runtime)", "Particles::integrateSlot (specialised)"};
+		for (unsigned int v = 0; v < 2; v++) {
+			measure(names[v], BENCH_PARTICLES, [&]() {
+				makeParticles();
+				particles->quadRebuildParticles();
+				particles->renderStep = false;
+				particles->stepKernel = (v == 0) ? (unsigned int)KERNEL_DYNAMIC : particles->kernelFlags();
+			}, [&]() {
+				for (unsigned int slot = 0; slot <= particles->tiles.size(); slot++) particles->integrateSlot(0, slot);
+			});
+		}
+		
+		// Blackholes holding still, each evaluated per particle and then read from the baked field
+		const char *bhNames[] = {"Particles::integrateSlot (bh exact)", "Particles::integrateSlot (bh field)"};
+		for (unsigned int v = 0; v < 2; v++) {
+			measure(bhNames[v], BENCH_PARTICLES, [&]() {
+				makeParticles();
+				for (unsigned int k = 0; k < BENCH_BH; k++) {
+					particles->createBH(particles->randDouble(0, resX), particles->randDouble(0, resY), 1000, 20, COLLISION);
+				}
+				for (unsigned int k = 0; k < particles->bhV.size(); k++) particles->bhV[k].stillSteps = FIELD_STILL;
+				particles->bhFieldCache = (v == 1);
+				particles->quadRebuildParticles();
+				particles->prepareStep();
+				particles->renderStep = false;
+			}, [&]() {
+				for (unsigned int slot = 0; slot <= particles->tiles.size(); slot++) particles->integrateSlot(0, slot);
+			});
+		}
+		
+		// One field lookup per particle, however many walls there are
+		makeParticles();
+		for (unsigned int k = 0; k < BENCH_OBSTACLES; k++) {
+			particles->obstacles.addSegment(particles->randDouble(0, resX), particles->randDouble(0, resY),
+																			particles->randDouble(0, resX), particles->randDouble(0, resY), 20);
+		}
+		particles->obstacles.update(resX, resY);
+		std::vector<Ball*> &balls = particles->ballV;
+		volatile unsigned int touching = 0;
+		measure("ObstacleField::contact", balls.size(), []() {}, [&]() {
+			unsigned int count = 0;
+			for (unsigned int i = 0; i < balls.size(); i++) {
+				scalar gap, nx, ny;
+				if (particles->obstacles.contact(balls[i]->x, balls[i]->y, balls[i]->radius, gap, nx, ny)) count++;
+			}
+			touching = count;
+		});
+	}
+	
+	void benchCompaction() {
+		// Every tenth particle dead, as after an erase
+		measure("Particles::cleanParticles", BENCH_PARTICLES, [&]() {
+			makeParticles();
+			for (unsigned int i = 0; i < particles->pSize; i += 10) particles->ballV[i]->alive = false;
+			particles->deadParticles = (particles->pSize + 9)/10;
+		}, [&]() {
+			particles->cleanParticles();
+		});
+	}
+
+	// Contended locking and barrier waits across every core
+	// Helper threads are started once and park between runs, so a run times only the
+	// contended loop; the calling thread takes part as the last of them
+	// With one core they would only take turns on it, so nothing is measured
+	void benchSync() {
+		unsigned int numThreads = std::thread::hardware_concurrency();
+		if (numThreads < 2) {
+			std::cout << "SpinLock, SpinningBarrier skipped, they need more than one core\n";
+			return;
+		}
+
+		SpinLock lock;
+		volatile unsigned int counter = 0;
+		SpinningBarrier barrier(numThreads);
+		std::atomic<int> job(0); // 0 locks, 1 barrier waits, -1 quit
+		std::atomic<unsigned int> round(0), finished(0);
+		auto work = [&]() {
+			if (job.load() == 0) {
+				for (unsigned int k = 0; k < BENCH_LOCK_OPS; k++) {
+					lock.lock();
+					counter = counter + 1;
+					lock.unlock();
+				}
+			}
+			else {
+				for (unsigned int k = 0; k < BENCH_BARRIER_ROUNDS; k++) barrier.wait();
+			}
+		};
+
+		std::vector<std::thread> helpers;
+		for (unsigned int t = 1; t < numThreads; t++) {
+			helpers.push_back(std::thread([&]() {
+				for (unsigned int seen = 1; ; seen++) {
+					while (round.load() < seen) {}
+					if (job.load() < 0) return;
+					work();
+					finished.fetch_add(1);
+				}
+			}));
+		}
+		auto runAll = [&]() {
+			finished.store(0);
+			round.fetch_add(1);
+			work();
+			while (finished.load() < numThreads - 1) {}
+		};
+
+		std::string threads = " (" + std::to_string(numThreads) + " threads)";
+		job.store(0);
+		measure("SpinLock" + threads, (uint64_t)numThreads*BENCH_LOCK_OPS, []() {}, runAll);
+		job.store(1);
+		measure("SpinningBarrier" + threads, BENCH_BARRIER_ROUNDS, []() {}, runAll);
+		job.store(-1);
+		round.fetch_add(1);
+		for (unsigned int t = 0; t < helpers.size(); t++) helpers[t].join();
+	}
+
+public:
+	Benchmark() : cacheMisses(PERF_CACHE_MISSES) {
+		resX = BENCH_RES_X;
+		resY = BENCH_RES_Y;
+		tickTime = 0.001;
+		particles = NULL;
+	}
+	~Benchmark() {
+		delete particles;
+	}
+
+	void run() {
+		std::cout << "benchmark (" << SCALAR_NAME << ")" << std::string(BENCH_NAME_WIDTH - 12 - strlen(SCALAR_NAME), ' ') << "ops\tns/op\tcache misses/op\n";
+		benchTree();
+		benchSort();
+		benchKernels();
+		benchCompaction();
+		benchSync();
+	}
+};
+
+}
+
+#endif
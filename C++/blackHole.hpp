@@ -5,6 +5,8 @@
 #include <vector>
 #include <cmath>
 
+#include "scalar.hpp"
+
 #define MOUSE_FILT 10.0
 
 namespace z {
@@ -17,12 +19,13 @@ enum InteractionSetting {
 
 class BlackHole {
 public:
-	double x, y;
-	double xMove, yMove;
-	double surfaceAccel, centerAccel;
-	double diameter, radius;
+	scalar x, y;
+	scalar xMove, yMove;
+	scalar surfaceAccel, centerAccel;
+	scalar diameter, radius;
 	bool active;
 	InteractionSetting interact;
+	unsigned int stillSteps; // Steps since it last moved, counted by Particles::moveBH
 	
 	sf::CircleShape ballShape;
 	
@@ -54,6 +57,7 @@ public:
 		this->y = y;
 		this->xMove = x;
 		this->yMove = y;
+		stillSteps = 0;
 		ballShape.setPosition(x - radius, y - radius);
 	}
 
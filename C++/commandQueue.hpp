@@ -0,0 +1,95 @@
+#ifndef COMMAND_QUEUE_HPP
+#define COMMAND_QUEUE_HPP
+
+#include <atomic>
+
+#include "blackHole.hpp"
+
+#define COMMAND_QUEUE_SIZE 1024 // Must be a power of two
+
+namespace z {
+
+enum CommandType {
+	CMD_CREATE_CLOUD, // x, y, rad, vel, dir, diaClass, densityClass, stationary, force
+	CMD_DEACTIVATE_CLOUD, // x, y, rad
+	CMD_DEACTIVATE_CLOUD_CLASS, // x, y, rad, diaClass, densityClass
+	CMD_IMMOBILIZE_CLOUD, // x, y, rad
+	CMD_MOVE_CLOUD, // x, y
+	CMD_MOBILIZE_CLOUD,
+	CMD_CREATE_BH, // x, y, vel (surface accel), rad (diameter), interact
+	CMD_PLACE_BH0, // x, y
+	CMD_MOVE_BH0, // x, y
+	CMD_HIDE_BH0,
+	CMD_SIZE_BH0, // rad
+	CMD_ACCEL_BH0, // vel
+	CMD_CLEAR,
+	CMD_ZERO_VEL,
+	CMD_SET_COLLISIONS, // flag
+	CMD_SET_STICKYNESS, // flag
+	CMD_SET_GRAVITY, // vel
+	CMD_SET_BOUND_CEILING, // flag
+	CMD_SET_BOUND_WALLS, // flag
+	CMD_SET_BOUND_FLOOR, // flag
+	CMD_SET_QUAD_REBUILD, // flag
+	CMD_SET_SLEEPING, // flag
+	CMD_SET_BH_FIELD, // flag
+	CMD_ADD_WALL, // x, y to x2, y2, rad (thickness)
+	CMD_CLEAR_WALLS,
+	CMD_ADD_OUTLINE_POINT, // x, y
+	CMD_CLOSE_OUTLINE, // The points added since the last close become a solid outline
+	CMD_PRINT_PARTICLES
+};
+
+struct Command {
+	CommandType type;
+	double x, y, rad, vel, dir;
+	double x2, y2;
+	int diaClass, densityClass;
+	bool stationary, force, flag;
+	InteractionSetting interact;
+
+	Command() {}
+	Command(CommandType t) : type(t), x(0), y(0), rad(0), vel(0), dir(0), x2(0), y2(0), diaClass(0), densityClass(0),
+		stationary(false), force(false), flag(false), interact(COLLISION) {}
+};
+
+// Lock-free ring buffer for exactly one pushing thread and one popping thread
+// Edits from the draw thread wait here until physics reaches a step boundary
+class CommandQueue {
+private:
+	Command ring[COMMAND_QUEUE_SIZE];
+	// Padded rather than aligned, so new still gets the alignment it expects
+	char padRing[64]; // Keep head off the last slots' cache line
+	std::atomic<unsigned int> head; // Next slot to pop, only written by the consumer
+	char padHead[64 - sizeof(std::atomic<unsigned int>)];
+	std::atomic<unsigned int> tail; // Next slot to push, only written by the producer
+	char padTail[64 - sizeof(std::atomic<unsigned int>)];
+
+public:
+	CommandQueue() : head(0), tail(0) {}
+
+	// False if the queue is full, in which case the command is dropped
+	bool push(const Command &cmd) {
+		unsigned int t = tail.load(std::memory_order_relaxed);
+		if (t - head.load(std::memory_order_acquire) == COMMAND_QUEUE_SIZE) return false;
+		ring[t & (COMMAND_QUEUE_SIZE - 1)] = cmd;
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool pop(Command &cmd) {
+		unsigned int h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire)) return false;
+		cmd = ring[h & (COMMAND_QUEUE_SIZE - 1)];
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool empty() {
+		return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+	}
+};
+
+}
+
+#endif
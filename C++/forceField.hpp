@@ -0,0 +1,168 @@
+#ifndef FORCE_FIELD_HPP
+#define FORCE_FIELD_HPP
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include "blackHole.hpp"
+#include "scalar.hpp"
+
+#define FIELD_CELL 8.0 // Pixels between field samples
+#define FIELD_MARGIN 64.0 // The field reaches this far past the window, for particles on open boundaries
+#define FIELD_NEAR 40.0 // Past a hole's surface, inside which it's evaluated exactly; more than any particle radius plus a cell
+#define FIELD_STILL 10 // Steps a blackhole has to hold still before it goes into the field
+#define FIELD_SLACK 0.5 // Pixels a baked blackhole may drift before the field is rebaked
+
+namespace z {
+
+// Summed pull of the blackholes that aren't moving, baked into a grid between steps
+// Far from every baked hole a particle reads its acceleration from the grid,
+// close to one it falls back on evaluating each hole, so contacts and kills stay exact
+class ForceField {
+private:
+	// A hole as it was when baked
+	struct Source {
+		unsigned int index;
+		scalar x, y;
+		scalar radius, centerAccel;
+	};
+
+	std::vector<Source> sources;
+	std::vector<unsigned char> baked; // Per blackhole, true if it's in the field
+	std::vector<float> accel; // x and y per sample, row by row from (-FIELD_MARGIN, -FIELD_MARGIN)
+	std::vector<unsigned char> nearHole; // Per cell, by its top left sample, true if close to a baked hole
+	int cols, rows;
+	int width, height; // Window the field was baked for
+
+	static bool wanted(const BlackHole &bh) {
+		return bh.active && bh.stillSteps >= FIELD_STILL && bh.centerAccel != 0;
+	}
+
+	// True if the holes that should be in the field aren't the ones that are
+	bool stale(const std::vector<BlackHole> &bhV, int w, int h) {
+		if (w != width || h != height || baked.size() != bhV.size()) return true;
+		unsigned int s = 0;
+		for (unsigned int k = 0; k < bhV.size(); k++) {
+			const BlackHole &bh = bhV[k];
+			if (!wanted(bh)) {
+				if (baked[k]) return true;
+				continue;
+			}
+			if (!baked[k] || s >= sources.size() || sources[s].index != k) return true;
+			const Source &src = sources[s++];
+			if (std::fabs(bh.x - src.x) > FIELD_SLACK || std::fabs(bh.y - src.y) > FIELD_SLACK ||
+					bh.radius != src.radius || bh.centerAccel != src.centerAccel) return true;
+		}
+		return false;
+	}
+
+	void bake(const std::vector<BlackHole> &bhV, int w, int h) {
+		width = w;
+		height = h;
+		sources.clear();
+		baked.assign(bhV.size(), 0);
+		for (unsigned int k = 0; k < bhV.size(); k++) {
+			if (wanted(bhV[k])) {
+				Source src = {k, bhV[k].x, bhV[k].y, bhV[k].radius, bhV[k].centerAccel};
+				sources.push_back(src);
+				baked[k] = 1;
+			}
+		}
+		if (sources.empty()) {
+			accel.clear();
+			nearHole.clear();
+			cols = rows = 0;
+			return;
+		}
+
+		cols = (int)ceil((w + 2.0*FIELD_MARGIN)/FIELD_CELL) + 1;
+		rows = (int)ceil((h + 2.0*FIELD_MARGIN)/FIELD_CELL) + 1;
+		accel.assign(2*cols*rows, 0.0f);
+		nearHole.assign(cols*rows, 0);
+		for (unsigned int s = 0; s < sources.size(); s++) {
+			const Source &src = sources[s];
+			double reach = src.radius + FIELD_NEAR;
+			int i0 = std::max(0, (int)floor((src.x - reach + FIELD_MARGIN)/FIELD_CELL));
+			int i1 = std::min(cols - 1, (int)floor((src.x + reach + FIELD_MARGIN)/FIELD_CELL));
+			int j0 = std::max(0, (int)floor((src.y - reach + FIELD_MARGIN)/FIELD_CELL));
+			int j1 = std::min(rows - 1, (int)floor((src.y + reach + FIELD_MARGIN)/FIELD_CELL));
+			for (int j = j0; j <= j1; j++) {
+				for (int i = i0; i <= i1; i++) {
+					// Nearest point of the cell to the hole
+					double xCell = std::min(std::max((double)src.x, i*FIELD_CELL - FIELD_MARGIN), (i + 1)*FIELD_CELL - FIELD_MARGIN);
+					double yCell = std::min(std::max((double)src.y, j*FIELD_CELL - FIELD_MARGIN), (j + 1)*FIELD_CELL - FIELD_MARGIN);
+					if (pow(xCell - src.x, 2.0) + pow(yCell - src.y, 2.0) < reach*reach) nearHole[j*cols + i] = 1;
+				}
+			}
+
+			// Samples inside the hole are only ever read from nearHole cells
+			for (int j = 0; j < rows; j++) {
+				double dy = src.y - (j*FIELD_CELL - FIELD_MARGIN);
+				for (int i = 0; i < cols; i++) {
+					double dx = src.x - (i*FIELD_CELL - FIELD_MARGIN);
+					double distSq = dx*dx + dy*dy;
+					if (distSq <= (double)src.radius*src.radius) continue;
+					double dist = sqrt(distSq);
+					double term = src.centerAccel/distSq;
+					accel[2*(j*cols + i)] += (dx/dist)*term;
+					accel[2*(j*cols + i) + 1] += (dy/dist)*term;
+				}
+			}
+		}
+	}
+
+public:
+	ForceField() {
+		cols = rows = 0;
+		width = height = 0;
+	}
+
+	bool empty() const {
+		return sources.empty();
+	}
+
+	// True if the blackhole's pull is in the field
+	bool holds(unsigned int k) const {
+		return baked[k] != 0;
+	}
+
+	// Rebake if a hole was made, moved, resized or changed strength, only call between steps
+	// Disabled, the field is emptied and every hole is evaluated exactly
+	void update(const std::vector<BlackHole> &bhV, bool enabled, int w, int h) {
+		if (!enabled) {
+			if (!empty()) {
+				sources.clear();
+				baked.clear();
+				accel.clear();
+				nearHole.clear();
+				cols = rows = 0;
+			}
+		}
+		else if (stale(bhV, w, h)) bake(bhV, w, h);
+	}
+
+	// Acceleration from every baked hole at a point, interpolated
+	// False if the point is close to one of them or off the field, then nothing is read from it
+	template <typename T>
+	bool sample(T x, T y, T &ax, T &ay) const {
+		T gx = (x + T(FIELD_MARGIN))*T(1.0/FIELD_CELL);
+		T gy = (y + T(FIELD_MARGIN))*T(1.0/FIELD_CELL);
+		if (!(gx >= 0 && gy >= 0)) return false;
+		int i = (int)gx, j = (int)gy;
+		if (i >= cols - 1 || j >= rows - 1) return false;
+		int cell = j*cols + i;
+		if (nearHole[cell]) return false;
+		T fx = gx - i, fy = gy - j;
+		const float *top = &accel[2*cell], *bottom = &accel[2*(cell + cols)];
+		T xTop = top[0] + (top[2] - top[0])*fx, xBottom = bottom[0] + (bottom[2] - bottom[0])*fx;
+		T yTop = top[1] + (top[3] - top[1])*fx, yBottom = bottom[1] + (bottom[3] - bottom[1])*fx;
+		ax = xTop + (xBottom - xTop)*fy;
+		ay = yTop + (yBottom - yTop)*fy;
+		return true;
+	}
+};
+
+}
+
+#endif
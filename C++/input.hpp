@@ -46,6 +46,7 @@ public:
 	double shootVelDrag;
 	double bhRad;
 	double bhGrav;
+	double bh0Rad, bh0Grav; // Last values sent for the controllable blackhole
 	
 	double shootOrigin[2];
 	
@@ -64,8 +65,10 @@ public:
 	bool bhPermanent;
 	bool paintOvr;
 	bool paintForce;
+	bool paintFixed; // Painted particles go into the static tree
 	
 	sf::Vertex shootLine[2];
+	std::vector<double> outlineX, outlineY; // Corners of the outline being drawn
 	
 	sf::CircleShape mouseCircle;
 	
@@ -98,9 +101,58 @@ public:
 		bhPermanent = false;
 		paintOvr = false;
 		paintForce = false;
+		paintFixed = false;
 		
 		bhIinteract = COLLISION;
 		bhRad = particles->bhV[0].radius;
+		bh0Rad = particles->bhV[0].radius;
+		bh0Grav = particles->bhV[0].surfaceAccel;
+	}
+	
+	// Edits are queued and applied by physics between steps
+	void send(CommandType type, double x, double y, double rad) {
+		Command cmd(type);
+		cmd.x = x;
+		cmd.y = y;
+		cmd.rad = rad;
+		particles->commands.push(cmd);
+	}
+	void send(CommandType type) {
+		particles->commands.push(Command(type));
+	}
+	void sendErase(double x, double y) {
+		if (eraseFuncOnly) {
+			Command cmd(CMD_DEACTIVATE_CLOUD_CLASS);
+			cmd.x = x;
+			cmd.y = y;
+			cmd.rad = mouseRad;
+			cmd.diaClass = newBallDia;
+			cmd.densityClass = newBallDensity;
+			particles->commands.push(cmd);
+		}
+		else send(CMD_DEACTIVATE_CLOUD, x, y, mouseRad);
+	}
+	// Outlines with fewer than three corners are dropped
+	void sendOutline() {
+		if (outlineX.size() >= 3) {
+			for (unsigned int k = 0; k < outlineX.size(); k++) send(CMD_ADD_OUTLINE_POINT, outlineX[k], outlineY[k], 0);
+			send(CMD_CLOSE_OUTLINE);
+		}
+		outlineX.clear();
+		outlineY.clear();
+	}
+	void sendCloud(double x, double y, double vel, double dir, bool force, bool stationary) {
+		Command cmd(CMD_CREATE_CLOUD);
+		cmd.x = x;
+		cmd.y = y;
+		cmd.rad = mouseRad;
+		cmd.vel = vel;
+		cmd.dir = dir;
+		cmd.diaClass = newBallDia;
+		cmd.densityClass = newBallDensity;
+		cmd.force = force;
+		cmd.stationary = stationary;
+		particles->commands.push(cmd);
 	}
 	
 	void update() {
@@ -113,45 +165,46 @@ public:
 			
 			if (modeChanged) {
 				freezeCircle = false;
-				particles->mobilizeCloud();
+				outlineX.clear();
+				outlineY.clear();
+				send(CMD_MOBILIZE_CLOUD);
 			}
 			
 			switch(mouseMode) {
 				case 1: // Erase
 					if (sf::Mouse::isButtonPressed(sf::Mouse::Left)) {
-						if (eraseFuncOnly) particles->deactivateCloud(mouseX, mouseY, mouseRad, newBallDia, newBallDensity);
-						else particles->deactivateCloud(mouseX, mouseY, mouseRad);
+						sendErase(mouseX, mouseY);
 					}
 					break;
 				case 2: // Drag
 					if (mousePressed) {
-						particles->mobilizeCloud();
-						particles->immobilizeCloud(mouseX, mouseY, mouseRad);
+						send(CMD_MOBILIZE_CLOUD);
+						send(CMD_IMMOBILIZE_CLOUD, mouseX, mouseY, mouseRad);
 					}
 					else if (mouseHeld) {
-						particles->moveCloud(mouseX, mouseY);
+						send(CMD_MOVE_CLOUD, mouseX, mouseY, 0);
 					}
 					else if (mouseReleased) {
-						particles->mobilizeCloud();
+						send(CMD_MOBILIZE_CLOUD);
 					}
 					break;
 				case 3: // Paint
 					if (paintOvr) {
 						if (mouseReleased && mouseX <= *resX) {
-							particles->deactivateCloud(mouseX, mouseY, mouseRad);
-							particles->createCloud(mouseX, mouseY, mouseRad, 0, 0, newBallDia, newBallDensity, false, true);
+							send(CMD_DEACTIVATE_CLOUD, mouseX, mouseY, mouseRad);
+							sendCloud(mouseX, mouseY, 0, 0, true, paintFixed);
 						}
 					}
 					else if (sf::Mouse::isButtonPressed(sf::Mouse::Left) && mouseX <= *resX) {
-						particles->createCloud(mouseX, mouseY, mouseRad, 0, 0, newBallDia, newBallDensity, false, paintForce);
+						sendCloud(mouseX, mouseY, 0, 0, paintForce, paintFixed);
 					}
 					break;
 				case 4: // Shoot
 					switch (shootMode) {
 						case 1:
 							if (mouseReleased && mouseX <= *resX) {
-								particles->deactivateCloud(mouseX, mouseY, mouseRad);
-								particles->createCloud(mouseX, mouseY, mouseRad, shootVelClick, shootAngClick, newBallDia, newBallDensity, false, false);
+								send(CMD_DEACTIVATE_CLOUD, mouseX, mouseY, mouseRad);
+								sendCloud(mouseX, mouseY, shootVelClick, shootAngClick, false, false);
 							}
 							break;
 						case 2:
@@ -174,8 +227,8 @@ public:
 									shootAngDrag = atan((shootOrigin[1]-mouseY)/(shootOrigin[0]-mouseX));
 							}
 							else if (mouseReleased && freezeCircle) {
-								particles->deactivateCloud(shootOrigin[0], shootOrigin[1], mouseRad);
-								particles->createCloud(shootOrigin[0], shootOrigin[1], mouseRad, shootVelDrag, shootAngDrag, newBallDia, newBallDensity, false, false);
+								send(CMD_DEACTIVATE_CLOUD, shootOrigin[0], shootOrigin[1], mouseRad);
+								sendCloud(shootOrigin[0], shootOrigin[1], shootVelDrag, shootAngDrag, false, false);
 								freezeCircle = false;
 							}
 							break;
@@ -183,27 +236,50 @@ public:
 					break;
 				case 5: // Place Blackhole
 					if (mouseReleased && mouseX <= *resX) {
-						particles->createBH(mouseX, mouseY, bhGrav, bhRad*2.0, bhIinteract);
+						Command cmd(CMD_CREATE_BH);
+						cmd.x = mouseX;
+						cmd.y = mouseY;
+						cmd.vel = bhGrav;
+						cmd.rad = bhRad*2.0;
+						cmd.interact = bhIinteract;
+						particles->commands.push(cmd);
 					}
 					break;
 				case 6: // Control Blackhole
 					if (sf::Mouse::isButtonPressed(sf::Mouse::Left) && mouseX <= *resX) {
-						if (mousePressed && !bhPermanent) {
-							particles->bhV[0].setPosition(mouseX, mouseY);
-							particles->bhV[0].active = true;
-						}
-						else {
-							particles->bhV[0].xMove = mouseX;
-							particles->bhV[0].yMove = mouseY;
-						}
+						if (mousePressed && !bhPermanent) send(CMD_PLACE_BH0, mouseX, mouseY, 0);
+						else send(CMD_MOVE_BH0, mouseX, mouseY, 0);
 					}
 					else if (mouseReleased) {
-						if (!bhPermanent) particles->bhV[0].active = false;
-						else {
-							particles->bhV[0].xMove = *resX/2.0;
-							particles->bhV[0].yMove = *resY/2.0;
+						if (!bhPermanent) send(CMD_HIDE_BH0);
+						else send(CMD_MOVE_BH0, *resX/2.0, *resY/2.0, 0);
+					}
+					break;
+				case 7: // Draw Walls, or with SHIFT held the corners of an outline, closed when SHIFT is let go
+					if (sf::Keyboard::isKeyPressed(sf::Keyboard::LShift) || 
+							sf::Keyboard::isKeyPressed(sf::Keyboard::RShift)) {
+						if (mousePressed && mouseX <= *resX && !freezeCircle) {
+							outlineX.push_back(mouseX);
+							outlineY.push_back(mouseY);
 						}
 					}
+					else if (!outlineX.empty()) sendOutline();
+					if (!outlineX.empty()) break;
+					if (mousePressed && mouseX <= *resX) {
+						freezeCircle = true;
+						shootOrigin[0] = mouseX;
+						shootOrigin[1] = mouseY;
+					}
+					else if (mouseReleased && freezeCircle) {
+						Command cmd(CMD_ADD_WALL);
+						cmd.x = shootOrigin[0];
+						cmd.y = shootOrigin[1];
+						cmd.x2 = mouseX;
+						cmd.y2 = mouseY;
+						cmd.rad = mouseRad;
+						particles->commands.push(cmd);
+						freezeCircle = false;
+					}
 					break;
 				default:
 					break;
@@ -223,6 +299,7 @@ public:
 					if (mouseHeld) break;
 				case 1:
 				case 3:
+				case 7:
 					mouseRad += event.mouseWheel.delta*RAD_TICK;
 					mouseRad = (mouseRad < MIN_RAD)?(MIN_RAD):((mouseRad > MAX_RAD)?MAX_RAD:mouseRad);
 					break;
@@ -260,16 +337,16 @@ public:
 				case 6:
 					if (sf::Keyboard::isKeyPressed(sf::Keyboard::LShift) || 
 							sf::Keyboard::isKeyPressed(sf::Keyboard::RShift)) {
-						particles->bhV[0].radius += event.mouseWheel.delta*BHRAD_TICK;
-						particles->bhV[0].radius = (particles->bhV[0].radius < MIN_BHRAD)?(MIN_BHRAD):
-								((particles->bhV[0].radius > MAX_BHRAD)?MAX_BHRAD:particles->bhV[0].radius);
-						particles->bhV[0].setSize(particles->bhV[0].radius*2.0);
+						bh0Rad += event.mouseWheel.delta*BHRAD_TICK;
+						bh0Rad = (bh0Rad < MIN_BHRAD)?(MIN_BHRAD):((bh0Rad > MAX_BHRAD)?MAX_BHRAD:bh0Rad);
+						send(CMD_SIZE_BH0, 0, 0, bh0Rad);
 					}
 					else {
-						particles->bhV[0].surfaceAccel -= event.mouseWheel.delta*GRAV_TICK;
-						particles->bhV[0].surfaceAccel = (particles->bhV[0].surfaceAccel < MIN_GRAV)?(MIN_GRAV):
-								((particles->bhV[0].surfaceAccel > MAX_GRAV)?MAX_GRAV:particles->bhV[0].surfaceAccel);
-						particles->bhV[0].setAttraction(particles->bhV[0].surfaceAccel);
+						bh0Grav -= event.mouseWheel.delta*GRAV_TICK;
+						bh0Grav = (bh0Grav < MIN_GRAV)?(MIN_GRAV):((bh0Grav > MAX_GRAV)?MAX_GRAV:bh0Grav);
+						Command cmd(CMD_ACCEL_BH0);
+						cmd.vel = bh0Grav;
+						particles->commands.push(cmd);
 					}
 					break;
 				default:
@@ -342,12 +419,37 @@ public:
 							sf::Keyboard::isKeyPressed(sf::Keyboard::RControl))) {
 						shootLine[0] = sf::Vertex(sf::Vector2f(particles->bhV[0].x, particles->bhV[0].y));
 						for (double ang = 0; ang <= PI2; ang += PIovr4) {
-							shootLine[1] = sf::Vertex(sf::Vector2f(particles->bhV[0].x + GRAV_LINE_SCALE*particles->bhV[0].surfaceAccel*cos(ang),
-																										 particles->bhV[0].y + GRAV_LINE_SCALE*particles->bhV[0].surfaceAccel*sin(ang)));
+							shootLine[1] = sf::Vertex(sf::Vector2f(particles->bhV[0].x + GRAV_LINE_SCALE*bh0Grav*cos(ang),
+																										 particles->bhV[0].y + GRAV_LINE_SCALE*bh0Grav*sin(ang)));
 							mainWindow->draw(shootLine, 2, sf::Lines);
 						}
 					}
 					break;
+				case 7:
+					// Wall thickness at the cursor, and the wall so far while dragging
+					mouseCircle.setRadius(mouseRad/2.0);
+					mouseCircle.setPosition(mouseX-mouseRad/2.0, mouseY-mouseRad/2.0);
+					mouseCircle.setFillColor(sf::Color::Transparent);
+					mainWindow->draw(mouseCircle);
+					if (freezeCircle) {
+						shootLine[0] = sf::Vertex(sf::Vector2f(shootOrigin[0], shootOrigin[1]));
+						shootLine[1] = sf::Vertex(sf::Vector2f(mouseX, mouseY));
+						mainWindow->draw(shootLine, 2, sf::Lines);
+					}
+					// The outline so far, closing through the cursor
+					for (unsigned int k = 0; k < outlineX.size(); k++) {
+						unsigned int next = k + 1;
+						shootLine[0] = sf::Vertex(sf::Vector2f(outlineX[k], outlineY[k]));
+						if (next < outlineX.size()) shootLine[1] = sf::Vertex(sf::Vector2f(outlineX[next], outlineY[next]));
+						else shootLine[1] = sf::Vertex(sf::Vector2f(mouseX, mouseY));
+						mainWindow->draw(shootLine, 2, sf::Lines);
+					}
+					if (!outlineX.empty()) {
+						shootLine[0] = sf::Vertex(sf::Vector2f(mouseX, mouseY));
+						shootLine[1] = sf::Vertex(sf::Vector2f(outlineX[0], outlineY[0]));
+						mainWindow->draw(shootLine, 2, sf::Lines);
+					}
+					break;
 				default:
 					break;
 			}
@@ -1,10 +1,42 @@
 // Written by Jonathan Wheless
 
 #include "simulation.hpp"
+#include "regression.hpp"
+#include "benchmark.hpp"
 
 // Load params from file and start simulation
-int main() {
-	z::Simulation sim = z::Simulation();
+// --seed N repeats particle placement and colours
+// --steps N uses a fixed timestep and exits after N steps, printing timing and a checksum
+// --regress checks the physics against regression.txt without opening a window, --regress-update rewrites it
+// --bench times the tree, collision and locking primitives on their own
+// --metrics PORT serves live metrics in Prometheus format on 127.0.0.1:PORT (Linux only)
+// --perf adds hardware counters per step phase and worker to the HUD and reports (Linux only)
+int main(int argc, char *argv[]) {
+	unsigned long seed = time(0);
+	unsigned int steps = 0;
+	bool perf = false;
+	unsigned int metricsPort = 0;
+	std::string mode;
+	for (int a = 1; a < argc; a++) {
+		std::string arg = argv[a];
+		if (arg == "--regress" || arg == "--regress-update" || arg == "--bench") mode = arg;
+		else if (arg == "--perf") perf = true;
+		else if (arg == "--seed" && a + 1 < argc) seed = strtoul(argv[++a], NULL, 10);
+		else if (arg == "--steps" && a + 1 < argc) steps = strtoul(argv[++a], NULL, 10);
+		else if (arg == "--metrics" && a + 1 < argc) metricsPort = strtoul(argv[++a], NULL, 10);
+	}
+	
+	if (mode == "--regress" || mode == "--regress-update") {
+		z::Regression regression(perf);
+		return (regression.check(mode == "--regress-update") == 0) ? 0 : 1;
+	}
+	if (mode == "--bench") {
+		z::Benchmark benchmark;
+		benchmark.run();
+		return 0;
+	}
+	
+	z::Simulation sim(seed, steps, perf, metricsPort);
 	sim.launch();
 }
 // ** To do **
@@ -0,0 +1,302 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+#include "perfCounters.hpp"
+
+#define METRICS_BUCKETS 16 // Histogram bounds double from METRICS_FIRST_BUCKET
+#define METRICS_FIRST_BUCKET 1000 // ns
+
+namespace z {
+
+static inline uint64_t metricsNow() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Durations sorted into fixed buckets, one writer at a time
+// Readers on other threads may see a count a moment before its sum
+class MetricHistogram {
+private:
+	std::atomic<uint64_t> counts[METRICS_BUCKETS + 1]; // Last one is +Inf
+	std::atomic<uint64_t> sum; // ns
+
+public:
+	MetricHistogram() {
+		for (unsigned int b = 0; b <= METRICS_BUCKETS; b++) counts[b] = 0;
+		sum = 0;
+	}
+
+	void observe(uint64_t ns) {
+		unsigned int b = 0;
+		uint64_t bound = METRICS_FIRST_BUCKET;
+		while (b < METRICS_BUCKETS && ns > bound) {
+			bound <<= 1;
+			b++;
+		}
+		counts[b].fetch_add(1, std::memory_order_relaxed);
+		sum.fetch_add(ns, std::memory_order_relaxed);
+	}
+
+	// Adds this histogram into totals, METRICS_BUCKETS + 2 values with the sum last
+	void addTo(uint64_t *totals) {
+		for (unsigned int b = 0; b <= METRICS_BUCKETS; b++) totals[b] += counts[b].load(std::memory_order_relaxed);
+		totals[METRICS_BUCKETS + 1] += sum.load(std::memory_order_relaxed);
+	}
+};
+
+// Live numbers from the physics threads, formatted for Prometheus
+// Writers only touch atomics they own, so recording never locks or allocates
+class StepMetrics {
+private:
+	struct Worker {
+		MetricHistogram phases[PERF_MAX_PHASES]; // Time per task
+		std::atomic<uint64_t> busy, idle, barrier; // ns running tasks, looking for one, and waiting at the step barriers
+		std::atomic<uint64_t> tasks;
+		char pad[64]; // Keep neighbouring workers' totals off the same cache line
+	};
+
+	std::vector<Worker*> workers;
+	std::vector<std::string> phaseNames;
+
+	// Written by worker 0 at the step boundary
+	MetricHistogram stepTimes;
+	std::atomic<uint64_t> steps, steals;
+	std::atomic<double> stepsPerSecond;
+	std::atomic<unsigned int> particleSlots, particlesAlive, bhSlots, bhAlive;
+
+	static void add(uint64_t ns, std::atomic<uint64_t> &total) {
+		total.store(total.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+	}
+
+	static void header(std::string &text, const char *name, const char *type, const char *help) {
+		text += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " " + type + "\n";
+	}
+
+	static void histogram(std::string &text, const char *name, const std::string &labels, uint64_t *totals) {
+		char line[160];
+		uint64_t cumulative = 0;
+		uint64_t bound = METRICS_FIRST_BUCKET;
+		for (unsigned int b = 0; b <= METRICS_BUCKETS; b++) {
+			cumulative += totals[b];
+			if (b < METRICS_BUCKETS) snprintf(line, sizeof(line), "%s_bucket{%sle=\"%g\"} %llu\n", name, labels.c_str(), bound*1e-9, (unsigned long long)cumulative);
+			else snprintf(line, sizeof(line), "%s_bucket{%sle=\"+Inf\"} %llu\n", name, labels.c_str(), (unsigned long long)cumulative);
+			text += line;
+			bound <<= 1;
+		}
+		std::string plain = labels.empty() ? "" : "{" + labels.substr(0, labels.size() - 1) + "}";
+		snprintf(line, sizeof(line), "%s_sum%s %.9f\n%s_count%s %llu\n", name, plain.c_str(), totals[METRICS_BUCKETS + 1]*1e-9,
+						 name, plain.c_str(), (unsigned long long)cumulative);
+		text += line;
+	}
+
+	static uint64_t residentBytes() {
+		unsigned long long size = 0, resident = 0;
+#ifdef __linux__
+		FILE *statm = fopen("/proc/self/statm", "r");
+		if (statm != NULL) {
+			if (fscanf(statm, "%llu %llu", &size, &resident) != 2) resident = 0;
+			fclose(statm);
+		}
+		resident *= sysconf(_SC_PAGESIZE);
+#endif
+		return resident;
+	}
+
+public:
+	StepMetrics(unsigned int numWorkers, const std::vector<std::string> &phaseNamesIn) {
+		phaseNames = phaseNamesIn;
+		for (unsigned int w = 0; w < numWorkers; w++) {
+			Worker *worker = new Worker;
+			worker->busy = worker->idle = worker->barrier = worker->tasks = 0;
+			workers.push_back(worker);
+		}
+		steps = steals = 0;
+		stepsPerSecond = 0;
+		particleSlots = particlesAlive = bhSlots = bhAlive = 0;
+	}
+	~StepMetrics() {
+		for (unsigned int w = 0; w < workers.size(); w++) delete workers[w];
+	}
+
+	// Only from the worker's own thread
+	void task(unsigned int worker, unsigned int phase, uint64_t ns) {
+		Worker *current = workers[worker];
+		if (phase < PERF_MAX_PHASES) current->phases[phase].observe(ns);
+		add(ns, current->busy);
+		add(1, current->tasks);
+	}
+	void idle(unsigned int worker, uint64_t ns) {
+		add(ns, workers[worker]->idle);
+	}
+	void barrier(unsigned int worker, uint64_t ns) {
+		add(ns, workers[worker]->barrier);
+	}
+
+	// Only from worker 0 at the step boundary
+	void step(uint64_t ns, double rate, unsigned int stolen, unsigned int pSize, unsigned int ballAlive,
+						unsigned int bhSize, unsigned int bhLive) {
+		stepTimes.observe(ns);
+		add(1, steps);
+		add(stolen, steals);
+		stepsPerSecond.store(rate, std::memory_order_relaxed);
+		particleSlots.store(pSize, std::memory_order_relaxed);
+		particlesAlive.store(ballAlive, std::memory_order_relaxed);
+		bhSlots.store(bhSize, std::memory_order_relaxed);
+		bhAlive.store(bhLive, std::memory_order_relaxed);
+	}
+
+	// Prometheus text exposition, safe from any thread
+	std::string format() {
+		std::string text;
+		char line[160];
+
+		header(text, "ball_steps_total", "counter", "Physics steps run");
+		text += "ball_steps_total " + std::to_string(steps.load(std::memory_order_relaxed)) + "\n";
+		header(text, "ball_steps_per_second", "gauge", "Filtered physics step rate");
+		snprintf(line, sizeof(line), "ball_steps_per_second %.3f\n", stepsPerSecond.load(std::memory_order_relaxed));
+		text += line;
+		header(text, "ball_particles_alive", "gauge", "Live particles (ballAlive)");
+		text += "ball_particles_alive " + std::to_string(particlesAlive.load(std::memory_order_relaxed)) + "\n";
+		header(text, "ball_particles_total", "gauge", "Particle slots, live or not (pSize)");
+		text += "ball_particles_total " + std::to_string(particleSlots.load(std::memory_order_relaxed)) + "\n";
+		header(text, "ball_blackholes_alive", "gauge", "Live blackholes");
+		text += "ball_blackholes_alive " + std::to_string(bhAlive.load(std::memory_order_relaxed)) + "\n";
+		header(text, "ball_blackholes_total", "gauge", "Blackhole slots, live or not");
+		text += "ball_blackholes_total " + std::to_string(bhSlots.load(std::memory_order_relaxed)) + "\n";
+		header(text, "ball_steals_total", "counter", "Tasks stolen between workers");
+		text += "ball_steals_total " + std::to_string(steals.load(std::memory_order_relaxed)) + "\n";
+
+		uint64_t totals[METRICS_BUCKETS + 2];
+		header(text, "ball_step_seconds", "histogram", "Wall time of each step");
+		memset(totals, 0, sizeof(totals));
+		stepTimes.addTo(totals);
+		histogram(text, "ball_step_seconds", "", totals);
+
+		header(text, "ball_task_seconds", "histogram", "Time per task, by step phase");
+		for (unsigned int p = 0; p < phaseNames.size() && p < PERF_MAX_PHASES; p++) {
+			memset(totals, 0, sizeof(totals));
+			for (unsigned int w = 0; w < workers.size(); w++) workers[w]->phases[p].addTo(totals);
+			histogram(text, "ball_task_seconds", "phase=\"" + phaseNames[p] + "\",", totals);
+		}
+
+		// Split of the work between workers
+		header(text, "ball_worker_busy_seconds_total", "counter", "Time each worker spent running tasks");
+		for (unsigned int w = 0; w < workers.size(); w++) {
+			snprintf(line, sizeof(line), "ball_worker_busy_seconds_total{worker=\"%u\"} %.9f\n", w, workers[w]->busy.load(std::memory_order_relaxed)*1e-9);
+			text += line;
+		}
+		header(text, "ball_worker_idle_seconds_total", "counter", "Time each worker spent looking for a task");
+		for (unsigned int w = 0; w < workers.size(); w++) {
+			snprintf(line, sizeof(line), "ball_worker_idle_seconds_total{worker=\"%u\"} %.9f\n", w, workers[w]->idle.load(std::memory_order_relaxed)*1e-9);
+			text += line;
+		}
+		header(text, "ball_worker_tasks_total", "counter", "Tasks each worker ran");
+		for (unsigned int w = 0; w < workers.size(); w++) {
+			snprintf(line, sizeof(line), "ball_worker_tasks_total{worker=\"%u\"} %llu\n", w, (unsigned long long)workers[w]->tasks.load(std::memory_order_relaxed));
+			text += line;
+		}
+		header(text, "ball_barrier_wait_seconds_total", "counter", "Time each worker spent waiting at the step barriers");
+		for (unsigned int w = 0; w < workers.size(); w++) {
+			snprintf(line, sizeof(line), "ball_barrier_wait_seconds_total{worker=\"%u\"} %.9f\n", w, workers[w]->barrier.load(std::memory_order_relaxed)*1e-9);
+			text += line;
+		}
+
+		header(text, "process_resident_memory_bytes", "gauge", "Resident memory");
+		text += "process_resident_memory_bytes " + std::to_string(residentBytes()) + "\n";
+		return text;
+	}
+};
+
+// Serves StepMetrics over HTTP on a localhost port, from its own thread
+// Any request gets the metrics; Linux only, elsewhere it never starts
+class MetricsServer {
+private:
+	StepMetrics *metrics;
+	int listenFd;
+	std::atomic<bool> serving;
+	std::thread *thread;
+
+	MetricsServer(const MetricsServer&) = delete;
+	MetricsServer& operator=(const MetricsServer&) = delete;
+
+	void serve() {
+#ifdef __linux__
+		while (serving) {
+			int client = accept(listenFd, NULL, NULL);
+			if (client < 0) continue; // Also woken here by shutdown()
+			char request[1024];
+			if (recv(client, request, sizeof(request), 0) > 0) {
+				std::string body = metrics->format();
+				std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+															 + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+				size_t sent = 0;
+				while (sent < response.size()) {
+					ssize_t n = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+					if (n <= 0) break;
+					sent += n;
+				}
+			}
+			close(client);
+		}
+#endif
+	}
+
+public:
+	MetricsServer(StepMetrics *metricsIn, unsigned int port) {
+		metrics = metricsIn;
+		listenFd = -1;
+		serving = false;
+		thread = NULL;
+#ifdef __linux__
+		listenFd = socket(AF_INET, SOCK_STREAM, 0);
+		int reuse = 1;
+		setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+		sockaddr_in address;
+		memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_port = htons(port);
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (listenFd < 0 || bind(listenFd, (sockaddr*)&address, sizeof(address)) < 0 || listen(listenFd, 4) < 0) {
+			std::cerr << "metrics: can't listen on 127.0.0.1:" << port << "\n";
+			if (listenFd >= 0) close(listenFd);
+			listenFd = -1;
+			return;
+		}
+		serving = true;
+		thread = new std::thread(&MetricsServer::serve, this);
+#else
+		std::cerr << "metrics: not supported on this platform\n";
+#endif
+	}
+	~MetricsServer() {
+#ifdef __linux__
+		if (thread != NULL) {
+			serving = false;
+			shutdown(listenFd, SHUT_RDWR);
+			thread->join();
+			delete thread;
+		}
+		if (listenFd >= 0) close(listenFd);
+#endif
+	}
+};
+
+}
+
+#endif
@@ -0,0 +1,222 @@
+#ifndef OBSTACLES_HPP
+#define OBSTACLES_HPP
+
+#include <SFML/Graphics.hpp>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#define SDF_CELL 4.0 // Pixels between field samples
+#define SDF_MARGIN 64.0 // The field reaches this far past the window, for particles on open boundaries
+#define SDF_BAND 32.0 // Distances are only kept this close to an obstacle, past the largest radius plus a cell
+#define OBSTACLE_CAP_STEPS 8 // Outline points around each rounded wall end
+#define OBSTACLE_COLOR sf::Color(100, 100, 120)
+
+namespace z {
+
+// Static walls and solid outlines, baked into a signed distance field
+// A particle's contact with all of them is then one interpolated lookup
+// Edited between steps only, read by every worker during one
+class ObstacleField {
+private:
+	// Wall of some thickness with rounded ends
+	struct Segment {
+		double x0, y0, x1, y1;
+		double halfWidth;
+	};
+	// Solid outline, closed back to its first point
+	struct Polygon {
+		std::vector<double> x, y;
+	};
+
+	std::vector<Segment> segments;
+	std::vector<Polygon> polygons;
+	std::vector<float> field; // Row by row from (-SDF_MARGIN, -SDF_MARGIN), negative inside an obstacle
+	int cols, rows;
+	int width, height; // Window the field was baked for
+	bool dirty;
+	std::vector<sf::Vertex> vertices; // Triangles, rebuilt with the field
+
+	static double segmentDistance(double px, double py, double x0, double y0, double x1, double y1) {
+		double dx = x1 - x0, dy = y1 - y0;
+		double lenSq = dx*dx + dy*dy;
+		double t = (lenSq > 0) ? ((px - x0)*dx + (py - y0)*dy)/lenSq : 0.0;
+		t = std::min(std::max(t, 0.0), 1.0);
+		double ex = px - (x0 + t*dx), ey = py - (y0 + t*dy);
+		return sqrt(ex*ex + ey*ey);
+	}
+
+	// Distance to the outline, negative inside it by the even-odd rule
+	static double polygonDistance(const Polygon &poly, double px, double py) {
+		double dist = HUGE_VAL;
+		bool inside = false;
+		unsigned int n = poly.x.size();
+		for (unsigned int a = 0, b = n - 1; a < n; b = a++) {
+			dist = std::min(dist, segmentDistance(px, py, poly.x[b], poly.y[b], poly.x[a], poly.y[a]));
+			if ((poly.y[a] > py) != (poly.y[b] > py) &&
+					px < poly.x[a] + (py - poly.y[a])*(poly.x[b] - poly.x[a])/(poly.y[b] - poly.y[a])) {
+				inside = !inside;
+			}
+		}
+		return inside ? -dist : dist;
+	}
+
+	// Cells covering a box, clipped to the field
+	void cellRange(double xMin, double xMax, double yMin, double yMax, int &i0, int &i1, int &j0, int &j1) {
+		i0 = std::max(0, (int)floor((xMin + SDF_MARGIN)/SDF_CELL));
+		i1 = std::min(cols - 1, (int)ceil((xMax + SDF_MARGIN)/SDF_CELL));
+		j0 = std::max(0, (int)floor((yMin + SDF_MARGIN)/SDF_CELL));
+		j1 = std::min(rows - 1, (int)ceil((yMax + SDF_MARGIN)/SDF_CELL));
+	}
+
+	void addTriangle(double ax, double ay, double bx, double by, double cx, double cy) {
+		vertices.push_back(sf::Vertex(sf::Vector2f(ax, ay), OBSTACLE_COLOR));
+		vertices.push_back(sf::Vertex(sf::Vector2f(bx, by), OBSTACLE_COLOR));
+		vertices.push_back(sf::Vertex(sf::Vector2f(cx, cy), OBSTACLE_COLOR));
+	}
+
+	// Union of every obstacle, only cells near one get more than SDF_BAND
+	void bake(int w, int h) {
+		width = w;
+		height = h;
+		dirty = false;
+		cols = (int)ceil((w + 2.0*SDF_MARGIN)/SDF_CELL) + 1;
+		rows = (int)ceil((h + 2.0*SDF_MARGIN)/SDF_CELL) + 1;
+		field.assign(cols*rows, SDF_BAND);
+		vertices.clear();
+
+		int i0, i1, j0, j1;
+		for (unsigned int s = 0; s < segments.size(); s++) {
+			const Segment &seg = segments[s];
+			double reach = seg.halfWidth + SDF_BAND;
+			cellRange(std::min(seg.x0, seg.x1) - reach, std::max(seg.x0, seg.x1) + reach,
+								std::min(seg.y0, seg.y1) - reach, std::max(seg.y0, seg.y1) + reach, i0, i1, j0, j1);
+			for (int j = j0; j <= j1; j++) {
+				for (int i = i0; i <= i1; i++) {
+					double d = segmentDistance(i*SDF_CELL - SDF_MARGIN, j*SDF_CELL - SDF_MARGIN, seg.x0, seg.y0, seg.x1, seg.y1) - seg.halfWidth;
+					float &cell = field[j*cols + i];
+					if (d < cell) cell = d;
+				}
+			}
+
+			// Capsule outline, convex so a fan from the middle covers it
+			double angle = atan2(seg.y1 - seg.y0, seg.x1 - seg.x0);
+			double xMid = (seg.x0 + seg.x1)/2.0, yMid = (seg.y0 + seg.y1)/2.0;
+			std::vector<double> ox, oy;
+			for (int end = 0; end < 2; end++) {
+				double xEnd = end ? seg.x0 : seg.x1, yEnd = end ? seg.y0 : seg.y1;
+				for (int k = 0; k <= OBSTACLE_CAP_STEPS; k++) {
+					double a = angle - 1.57079632679 + end*3.14159265359 + k*3.14159265359/OBSTACLE_CAP_STEPS;
+					ox.push_back(xEnd + seg.halfWidth*cos(a));
+					oy.push_back(yEnd + seg.halfWidth*sin(a));
+				}
+			}
+			for (unsigned int k = 0; k < ox.size(); k++) {
+				unsigned int next = (k + 1)%ox.size();
+				addTriangle(xMid, yMid, ox[k], oy[k], ox[next], oy[next]);
+			}
+		}
+
+		for (unsigned int p = 0; p < polygons.size(); p++) {
+			const Polygon &poly = polygons[p];
+			double xMin = *std::min_element(poly.x.begin(), poly.x.end()), xMax = *std::max_element(poly.x.begin(), poly.x.end());
+			double yMin = *std::min_element(poly.y.begin(), poly.y.end()), yMax = *std::max_element(poly.y.begin(), poly.y.end());
+			cellRange(xMin - SDF_BAND, xMax + SDF_BAND, yMin - SDF_BAND, yMax + SDF_BAND, i0, i1, j0, j1);
+			for (int j = j0; j <= j1; j++) {
+				for (int i = i0; i <= i1; i++) {
+					double d = polygonDistance(poly, i*SDF_CELL - SDF_MARGIN, j*SDF_CELL - SDF_MARGIN);
+					float &cell = field[j*cols + i];
+					if (d < cell) cell = d;
+				}
+			}
+
+			// Fan from the first point, right for convex or star-shaped outlines
+			for (unsigned int k = 1; k + 1 < poly.x.size(); k++) {
+				addTriangle(poly.x[0], poly.y[0], poly.x[k], poly.y[k], poly.x[k + 1], poly.y[k + 1]);
+			}
+		}
+	}
+
+public:
+	ObstacleField() {
+		cols = rows = 0;
+		width = height = 0;
+		dirty = false;
+	}
+
+	bool empty() const {
+		return segments.empty() && polygons.empty();
+	}
+
+	void addSegment(double x0, double y0, double x1, double y1, double thickness) {
+		Segment seg = {x0, y0, x1, y1, std::max(thickness, 1.0)/2.0};
+		segments.push_back(seg);
+		dirty = true;
+	}
+
+	// Needs at least three points
+	void addPolygon(const std::vector<double> &x, const std::vector<double> &y) {
+		if (x.size() < 3 || x.size() != y.size()) return;
+		Polygon poly;
+		poly.x = x;
+		poly.y = y;
+		polygons.push_back(poly);
+		dirty = true;
+	}
+
+	void clear() {
+		segments.clear();
+		polygons.clear();
+		dirty = true;
+	}
+
+	// Rebake if an obstacle or the window changed, only call between steps
+	void update(int w, int h) {
+		if (dirty || w != width || h != height) {
+			if (empty()) {
+				field.clear();
+				vertices.clear();
+				cols = rows = 0;
+				width = w;
+				height = h;
+				dirty = false;
+			}
+			else bake(w, h);
+		}
+	}
+
+	// True if a point is closer than reach to an obstacle, or inside one
+	// Then gives the interpolated distance and the unit normal pointing out of the obstacle
+	template <typename T>
+	bool contact(T x, T y, T reach, T &dist, T &nx, T &ny) const {
+		T gx = (x + T(SDF_MARGIN))*T(1.0/SDF_CELL);
+		T gy = (y + T(SDF_MARGIN))*T(1.0/SDF_CELL);
+		if (!(gx >= 0 && gy >= 0)) return false;
+		int i = (int)gx, j = (int)gy;
+		if (i >= cols - 1 || j >= rows - 1) return false;
+		T fx = gx - i, fy = gy - j;
+		const float *cell = &field[j*cols + i];
+		T d00 = cell[0], d10 = cell[1], d01 = cell[cols], d11 = cell[cols + 1];
+		T top = d00 + (d10 - d00)*fx;
+		T bottom = d01 + (d11 - d01)*fx;
+		dist = top + (bottom - top)*fy;
+		if (dist >= reach) return false;
+
+		// Gradient of the same bilinear patch
+		nx = (d10 - d00) + ((d11 - d01) - (d10 - d00))*fy;
+		ny = bottom - top;
+		T len = std::sqrt(nx*nx + ny*ny);
+		if (!(len > 0)) return false;
+		nx /= len;
+		ny /= len;
+		return true;
+	}
+
+	const std::vector<sf::Vertex>& shape() const {
+		return vertices;
+	}
+};
+
+}
+
+#endif
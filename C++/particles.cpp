@@ -2,6 +2,21 @@
 
 namespace z {
 
+	// Fills the table with integrateTile<FLAGS> for FLAGS and every combination below it
+	template <unsigned int FLAGS>
+	struct IntegrateKernels {
+		static void fill(Particles::IntegrateKernel *table) {
+			table[FLAGS] = &Particles::integrateTile<FLAGS>;
+			IntegrateKernels<FLAGS - 1>::fill(table);
+		}
+	};
+	template <>
+	struct IntegrateKernels<0> {
+		static void fill(Particles::IntegrateKernel *table) {
+			table[0] = &Particles::integrateTile<0>;
+		}
+	};
+
 	/////////////////
 	// Constructor //
 	/////////////////
@@ -15,17 +30,44 @@ namespace z {
 		pSize = 0;
 		
 		Quad::particles = this;
-		quadTree = new Quad(NULL, 0, LEVELS, 0, 0, *resX, 0, *resY);
+		quadTree = new Quad(NULL, 0, LEVELS, 0, 0, *resX, 0, *resY, MAX_PARTICLES);
+		staticTree = new Quad(NULL, 0, LEVELS, 0, 0, *resX, 0, *resY, 0); // Few residents, only added to between steps
+		staticAlive = 0;
+		staticDirty = false;
+		staticTile.clear();
+		
+		quadRebuild = false;
+		particleSleeping = false;
+		bhFieldCache = false;
+		quadNodes.resize(Quad::levelOffset(LEVELS + 1));
+		quadTree->indexNodes(quadNodes);
+		quadKeys.resize(MAX_PARTICLES);
+		quadSorted.resize(MAX_PARTICLES);
+		nodeStart.resize(quadNodes.size() + 1);
+		for (unsigned int p = 0; p < SORT_PARTS; p++) {
+			rebuildCount[p].resize(quadNodes.size());
+			rebuildOffset[p].resize(quadNodes.size());
+			rebuildStart[p] = rebuildStop[p] = 0;
+		}
+		
+		// Scheduler tiles are the quads at TILE_LEVEL, everything above them is shared between tiles
+		tiles.assign(quadNodes.begin() + Quad::levelOffset(TILE_LEVEL), quadNodes.begin() + Quad::levelOffset(TILE_LEVEL + 1));
+		upperNodes.assign(quadNodes.begin(), quadNodes.begin() + Quad::levelOffset(TILE_LEVEL));
+		setWorkers(1);
+		render.setTiles(tiles.size() + 2); // Then the upper quads, then the static particles
+		renderStep = true;
+		discReady = false;
+		IntegrateKernels<KERNEL_INTEGRATE_VARIANTS - 1>::fill(integrateKernels);
+		stepKernel = KERNEL_DYNAMIC; // Settings aren't known until the first step boundary
 		
 		BlackHole::tickTime = tickTime;
 		
-		Ball::boundCeiling = &boundCeiling;
-		Ball::boundWalls = &boundWalls;
-		Ball::boundFloor = &boundFloor;
 		Ball::sticky = &particleStickyness;
 		Ball::tickTime = tickTimeT;
 		Ball::resX = resXT;
 		Ball::resY = resYT;
+		Ball::rng = &rng;
+		Ball::buildMaterials();
 
 		ballV.reserve(MAX_PARTICLES);
 		bhV.reserve(MAX_BH);
@@ -34,51 +76,71 @@ namespace z {
 		bhV.push_back(bhPerm);
 		bhAlive = 1;
 		ballAlive = 0;
+		ballSleeping = 0;
 		maxParticleVel = 0;
+		kineticEnergy = xMomentum = yMomentum = 0;
+		contacts = 0;
+		migrations = 0;
+		deadParticles = 0;
 	}
 		
 	///////////////////////
 	// Particle Creation //
 	///////////////////////
 
-	// Populate the window with balls in random locations
+	// Populate the window with balls on a jittered lattice
+	// Cells are at least a diameter wide and each ball stays inside its own cell, so none overlap
 	void Particles::createInitBalls(unsigned int numBalls, int ballDia, int ballDensity) {
-		// Create number of starting balls at random locations
-		for (unsigned int i = 0; i < numBalls; i++ ) {
-			z::Ball *ball;
-			ball = new Ball(ballDia, ballDensity);
-			
-			double xPos, yPos;
-			int tryCount = 0;
-			bool collision = true;
-
-			// Make sure ball doesn't collide with another upon start
-			while (collision && tryCount <= NUM_TRIES) {
-				xPos = randDouble(ball->radius, *resX - ball->radius);
-				yPos = randDouble(ball->radius, *resY - ball->radius);
-				collision = false;
-				for (unsigned int j = 0; j < i; j++) {
-					if (sqrt(pow(xPos - ballV[j]->x, 2.0) + pow(yPos - ballV[j]->y, 2.0)) <= 2.f*ballDia)
-						collision = true;
-				}
-				tryCount++;
-			}
+		if (numBalls == 0) return;
+		double diameter = Ball::diameterTable[constrain(ballDia, 0, 2)];
+		
+		// Spread balls over the whole window, shrinking cells until they all fit
+		double cellSize = std::max(diameter, sqrt(double(*resX)*double(*resY)/numBalls));
+		unsigned int cols = *resX/cellSize;
+		unsigned int rows = *resY/cellSize;
+		while (cols*rows < numBalls && cellSize > diameter) {
+			cellSize = std::max(diameter, cellSize*0.95);
+			cols = *resX/cellSize;
+			rows = *resY/cellSize;
+		}
+		unsigned int cellCount = cols*rows;
+		if (numBalls > cellCount) numBalls = cellCount;
+		
+		double jitter = (cellSize - diameter)/2.0;
+		double xOffset = (*resX - cols*cellSize)/2.0 + cellSize/2.0;
+		double yOffset = (*resY - rows*cellSize)/2.0 + cellSize/2.0;
+		
+		// Partial shuffle picks which cells get a ball
+		std::vector<unsigned int> cells(cellCount);
+		for (unsigned int k = 0; k < cellCount; k++) cells[k] = k;
+		
+		ballV.reserve(ballV.size() + numBalls);
+		for (unsigned int i = 0; i < numBalls; i++) {
+			unsigned int pick = std::min(i + (unsigned int)randDouble(0, cellCount - i), cellCount - 1);
+			std::swap(cells[i], cells[pick]);
 			
-			ball->setPosition(xPos, yPos);
+			z::Ball *ball;
+			ball = ballPool.create(ballDia, ballDensity);
+			ball->setPosition(xOffset + (cells[i]%cols)*cellSize + randDouble(-jitter, jitter),
+									yOffset + (cells[i]/cols)*cellSize + randDouble(-jitter, jitter));
 			ballV.push_back(ball);
 			pSize++;
 		}
-		
-		for (unsigned int i = 0; i < ballV.size(); i++) {
-			quadTree->addParticle(ballV[i], true);
+		if (ballV.size() > quadKeys.size()) {
+			quadKeys.resize(ballV.size());
+			quadSorted.resize(ballV.size());
 		}
+		
+		// Build the tree in one pass rather than inserting one by one
+		quadRebuildParticles();
 	}
 
 	// Create a spherical cloud of particles
 	void Particles::createCloud(double x, double y, double rad, double vel, double dir,
 										int diaClass, int densityClass, bool stationary, bool force) {
-		std::vector<int> list;
-		int tempListPos;
+		// Handles stay checkable if compaction releases one of these before we are done
+		std::vector<BallHandle> list;
+		BallHandle tempHandle;
 				
 		double xIt, yIt;
 		double ballDia = Ball::diameterTable[diaClass];
@@ -90,15 +152,17 @@ namespace z {
 			if (j%2) xIt = x + ballDia*cos(PI60);
 			else xIt = x;
 			while (sqrt(pow(xIt - x, 2.0) + pow(yIt - y, 2.0)) < rad) {
-				tempListPos = createParticle(xIt, yIt, 0, 0, diaClass, densityClass, true, force);
-				if (tempListPos >= 0) list.push_back(tempListPos);
+				if (createParticle(xIt, yIt, 0, 0, diaClass, densityClass, true, force, tempHandle)) {
+					list.push_back(tempHandle);
+				}
 				xIt += ballDia;
 			}
 			if (j%2) xIt = x - ballDia*cos(PI60);
 			else xIt = x - ballDia;
 			while (sqrt(pow(xIt - x, 2.0) + pow(yIt - y, 2.0)) < rad) {
-				tempListPos = createParticle(xIt, yIt, 0, 0, diaClass, densityClass, true, force);
-				if (tempListPos >= 0) list.push_back(tempListPos);
+				if (createParticle(xIt, yIt, 0, 0, diaClass, densityClass, true, force, tempHandle)) {
+					list.push_back(tempHandle);
+				}
 				xIt -= ballDia;
 			}
 			yIt += ballDia*sin(PI60);
@@ -107,15 +171,18 @@ namespace z {
 		double velX = vel*cos(dir);
 		double velY = vel*sin(dir);
 		for (unsigned int j = 0; j < list.size(); j++) {
-			if (!stationary) ballV[list[j]]->stationary = false;
-			ballV[list[j]]->xVel = velX;
-			ballV[list[j]]->yVel = velY;
+			Ball *ball = ballPool.resolve(list[j]);
+			if (ball == NULL) continue;
+			if (stationary) fixParticle(ball);
+			else ball->stationary = false;
+			ball->xVel = velX;
+			ball->yVel = velY;
 		}
 	}
 	
 	// Singular particle creation with collision checking
-	int Particles::createParticle(double xPos, double yPos, double vel, double dir,
-											int diaClass, int densityClass, bool stationary, bool force) {
+	bool Particles::createParticle(double xPos, double yPos, double vel, double dir,
+											int diaClass, int densityClass, bool stationary, bool force, BallHandle &handle) {
 
 		double radius = Ball::diameterTable[diaClass]/2.0;
 				
@@ -124,14 +191,8 @@ namespace z {
 			collision = true;
 		}
 		else if (!force) {
-			for (unsigned int j = 0; j < ballV.size(); j++) {
-				if (ballV[j]->alive) {
-					if (sqrt(pow(xPos - ballV[j]->x, 2.0) + pow(yPos - ballV[j]->y, 2.0)) + 0.001 < radius + ballV[j]->radius) {
-						collision = true;
-					}
-				}
-			}
-			for (unsigned int k = 0; k < bhV.size(); k++) {
+			collision = quadTree->checkOverlap(xPos, yPos, radius) || staticTree->checkOverlap(xPos, yPos, radius);
+			for (unsigned int k = 0; k < bhV.size() && !collision; k++) {
 				if (bhV[k].active) {
 					if (sqrt(pow(xPos - bhV[k].x, 2.0) + pow(yPos - bhV[k].y, 2.0)) + 0.001 < radius + bhV[k].radius) {
 						collision = true;
@@ -139,36 +200,19 @@ namespace z {
 				}
 			}
 		}
+		// Dead particles are compacted away each step, so new ones always come from the pool's free list
 		if (!collision && ballV.size() < MAX_PARTICLES) {
-			unsigned int i = 1;
-			bool inactiveBall = false;
-			while(i < ballV.size()) {
-				if(!ballV[i]->alive) {
-					inactiveBall = true;
-					break;
-				}
-				i++;
-			}
-			if (inactiveBall) {
-				ballV[i]->setSize(diaClass);
-				ballV[i]->setMass(densityClass);
-				ballV[i]->setPosition(xPos, yPos);
-				ballV[i]->alive = true;
-				ballV[i]->stationary = stationary;
-				return i;
-			}
-			else {
-				z::Ball *ball;
-				ball = new Ball(diaClass, densityClass);
-				ball->setPosition(xPos, yPos);
-				ball->stationary = stationary;
-				quadTree->addParticle(ball, true);
-				ballV.push_back(ball);
-				pSize++;
-				return ballV.size() - 1;
-			}
+			z::Ball *ball;
+			ball = ballPool.create(diaClass, densityClass);
+			ball->setPosition(xPos, yPos);
+			ball->stationary = stationary;
+			quadTree->addParticle(ball, true);
+			ballV.push_back(ball);
+			pSize++;
+			handle = ballPool.handle(ball);
+			return true;
 		}
-		else return -1;
+		return false;
 	}
 	
 		void Particles::createBH(int x, int y, double surfaceAccel, int diameter, InteractionSetting interact) {
@@ -198,10 +242,191 @@ namespace z {
 		}
 	}
 	
+	// Move a particle from the tree into the static tree, where it stays until dragged or erased
+	void Particles::fixParticle(Ball *ball) {
+		if (ball->fixed) return;
+		ball->quadResidence->checkIfResident(ball->id, true);
+		ball->quadResidence->tooManyNulls = true;
+		ball->fixed = true;
+		ball->stationary = true;
+		ball->xVel = ball->yVel = 0;
+		ball->setPosition(ball->x, ball->y);
+		staticTree->addParticle(ball, true);
+		staticDirty = true;
+	}
+	
+	// Back into the tree, still stationary until let go
+	void Particles::unfixParticle(Ball *ball) {
+		if (!ball->fixed) return;
+		ball->quadResidence->checkIfResident(ball->id, true);
+		ball->quadResidence->tooManyNulls = true;
+		ball->fixed = false;
+		quadTree->addParticle(ball, true);
+		staticDirty = true;
+	}
+	
+	// Tidy the static tree and redraw its particles, after edits have changed it
+	void Particles::buildStatic() {
+		staticTree->cleanResidentList();
+		StepStats stats;
+		stats.reset();
+		staticTile.clear();
+		emitTile(staticTree, true, stats, &staticTile);
+		staticAlive = stats.alive;
+		staticDirty = false;
+	}
+	
+	// Stickyness widens every particle's bounds, so they all resort next step
+	void Particles::setStickyness(bool sticky) {
+		particleStickyness = sticky;
+		wakeAll();
+		for (unsigned int i = 0; i < pSize; i++) ballV[i]->setReach();
+	}
+	
+	void Particles::setSleeping(bool sleeping) {
+		particleSleeping = sleeping;
+		if (!sleeping) wakeAll();
+	}
+	
+	// For edits that change what every particle feels
+	void Particles::wakeAll() {
+		for (unsigned int i = 0; i < pSize; i++) {
+			if (ballV[i]->asleep) ballV[i]->wake();
+		}
+	}
+	
+	// Wake the sleepers an edit reaches, the rest of their piles follow as they start moving
+	void Particles::wakeCloud(double x, double y, double rad) {
+		queryResult.clear();
+		quadTree->queryCircle(x, y, rad + SLEEP_WAKE_MARGIN, queryResult);
+		for (unsigned int i = 0; i < queryResult.size(); i++) {
+			if (queryResult[i]->asleep) queryResult[i]->wake();
+		}
+	}
+	
 	///////////////////////////
 	// Particle Manipulation //
 	///////////////////////////
 	
+	// Apply queued edits in the order they were made
+	// Only call between steps, from the thread currently consuming the queue
+	// Returns true if there were any
+	bool Particles::applyCommands() {
+		Command cmd;
+		bool applied = false;
+		while (commands.pop(cmd)) {
+			applied = true;
+			switch (cmd.type) {
+				case CMD_CREATE_CLOUD:
+					createCloud(cmd.x, cmd.y, cmd.rad, cmd.vel, cmd.dir, cmd.diaClass, cmd.densityClass, cmd.stationary, cmd.force);
+					break;
+				case CMD_DEACTIVATE_CLOUD:
+					deactivateCloud(cmd.x, cmd.y, cmd.rad);
+					break;
+				case CMD_DEACTIVATE_CLOUD_CLASS:
+					deactivateCloud(cmd.x, cmd.y, cmd.rad, cmd.diaClass, cmd.densityClass);
+					break;
+				case CMD_IMMOBILIZE_CLOUD:
+					immobilizeCloud(cmd.x, cmd.y, cmd.rad);
+					break;
+				case CMD_MOVE_CLOUD:
+					moveCloud(cmd.x, cmd.y);
+					break;
+				case CMD_MOBILIZE_CLOUD:
+					mobilizeCloud();
+					break;
+				case CMD_CREATE_BH:
+					createBH(cmd.x, cmd.y, cmd.vel, cmd.rad, cmd.interact);
+					wakeAll();
+					break;
+				case CMD_PLACE_BH0:
+					bhV[0].setPosition(cmd.x, cmd.y);
+					bhV[0].active = true;
+					wakeAll();
+					break;
+				case CMD_MOVE_BH0:
+					bhV[0].xMove = cmd.x;
+					bhV[0].yMove = cmd.y;
+					if (cmd.flag) bhV[0].active = true;
+					break;
+				case CMD_HIDE_BH0:
+					bhV[0].active = false;
+					wakeAll();
+					break;
+				case CMD_SIZE_BH0:
+					bhV[0].radius = cmd.rad;
+					bhV[0].setSize(cmd.rad*2.0);
+					wakeAll();
+					break;
+				case CMD_ACCEL_BH0:
+					bhV[0].setAttraction(cmd.vel);
+					wakeAll();
+					break;
+				case CMD_CLEAR:
+					clearParticles();
+					obstacles.clear();
+					break;
+				case CMD_ZERO_VEL:
+					zeroVel();
+					break;
+				case CMD_SET_COLLISIONS:
+					particleCollisions = cmd.flag;
+					wakeAll();
+					break;
+				case CMD_SET_STICKYNESS:
+					setStickyness(cmd.flag);
+					break;
+				case CMD_SET_GRAVITY:
+					linGravity = cmd.vel;
+					wakeAll();
+					break;
+				case CMD_SET_BOUND_CEILING:
+					boundCeiling = cmd.flag;
+					wakeAll();
+					break;
+				case CMD_SET_BOUND_WALLS:
+					boundWalls = cmd.flag;
+					wakeAll();
+					break;
+				case CMD_SET_BOUND_FLOOR:
+					boundFloor = cmd.flag;
+					wakeAll();
+					break;
+				case CMD_SET_QUAD_REBUILD:
+					quadRebuild = cmd.flag;
+					break;
+				case CMD_SET_SLEEPING:
+					setSleeping(cmd.flag);
+					break;
+				case CMD_SET_BH_FIELD:
+					bhFieldCache = cmd.flag;
+					break;
+				case CMD_ADD_WALL:
+					obstacles.addSegment(cmd.x, cmd.y, cmd.x2, cmd.y2, cmd.rad);
+					wakeAll();
+					break;
+				case CMD_CLEAR_WALLS:
+					obstacles.clear();
+					wakeAll();
+					break;
+				case CMD_ADD_OUTLINE_POINT:
+					outlineX.push_back(cmd.x);
+					outlineY.push_back(cmd.y);
+					break;
+				case CMD_CLOSE_OUTLINE:
+					obstacles.addPolygon(outlineX, outlineY);
+					outlineX.clear();
+					outlineY.clear();
+					wakeAll();
+					break;
+				case CMD_PRINT_PARTICLES:
+					printParticles();
+					break;
+			}
+		}
+		return applied;
+	}
+	
 	// Erase dead particles
 	void Particles::cleanParticles() {
 		int frontSwap = 0;
@@ -218,14 +443,59 @@ namespace z {
 			else break;
 		}
 		if (backSwap < ballV.size()) {
-			int eraseStart = (backSwap < 50)?50:backSwap;
-			for (unsigned int k = eraseStart; k < ballV.size(); k++)
+			// Anyone still holding a handle to these finds out through the generation check
+			for (unsigned int k = backSwap; k < ballV.size(); k++) {
 				ballV[k]->quadResidence->checkIfResident(ballV[k]->id, true);
-			ballV.erase(ballV.begin()+eraseStart, ballV.end());
+				if (ballV[k]->fixed) {
+					ballV[k]->quadResidence->tooManyNulls = true;
+					staticDirty = true;
+				}
+				ballPool.release(ballV[k]);
+			}
+			deadParticles -= ballV.size() - backSwap;
+			ballV.erase(ballV.begin()+backSwap, ballV.end());
 			pSize = ballV.size();
 		}
 	}
 	
+	// Put ballV in Z-order so particles near in space are near in memory
+	void Particles::reorderParticles() {
+		const double scaleX = 65535.0/(quadTree->xMax - quadTree->xMin);
+		const double scaleY = 65535.0/(quadTree->yMax - quadTree->yMin);
+		
+		reorderKeys.resize(ballV.size());
+		for (unsigned int k = 0; k < ballV.size(); k++) {
+			unsigned int code = 0xFFFFFFFF; // Dead particles go to the back
+			if (ballV[k]->alive) {
+				unsigned int xCell = constrain(int((ballV[k]->x - quadTree->xMin)*scaleX), 0, 65535);
+				unsigned int yCell = constrain(int((ballV[k]->y - quadTree->yMin)*scaleY), 0, 65535);
+				code = spreadBits(xCell) | (spreadBits(yCell) << 1);
+			}
+			reorderKeys[k] = std::make_pair(code, k);
+		}
+		std::sort(reorderKeys.begin(), reorderKeys.end());
+		
+		reorderV.resize(ballV.size());
+		for (unsigned int k = 0; k < ballV.size(); k++) {
+			reorderV[k] = ballV[reorderKeys[k].second];
+		}
+		ballV.swap(reorderV);
+		migrations = 0;
+	}
+	
+	bool Particles::maintenanceDue() {
+		return deadParticles > 0 || migrations > REORDER_DRIFT*pSize ||
+				(bhV.size() - bhAlive >= BH_CLEAN && bhV.size() - BH_CLEAN > 1);
+	}
+	
+	// Compact and reorder ballV, compact bhV
+	// Only call between steps, while no other thread is using ballV indices
+	void Particles::maintainParticles() {
+		if (deadParticles > 0) cleanParticles();
+		if (migrations > REORDER_DRIFT*pSize) reorderParticles();
+		if (bhV.size() - bhAlive >= BH_CLEAN && bhV.size() - BH_CLEAN > 1) cleanBH();
+	}
+	
 	void Particles::cleanBH() {
 		int frontSwap = 1;
 		int backSwap = bhV.size() - 1;
@@ -259,9 +529,12 @@ namespace z {
 	}
 	
 	void Particles::clearParticles() {
+		int died = 0;
 		for (unsigned int i = 0; i < pSize; i++) {
+			if (ballV[i]->alive) died++;
 			ballV[i]->alive = false;
 		}
+		deadParticles += died;
 		for (unsigned int j = 1; j < bhV.size(); j++) {
 			bhV[j].active = false;
 		}
@@ -270,14 +543,14 @@ namespace z {
 	void Particles::immobilizeCloud(double x, double y, double rad) {
 		prevX = x;
 		prevY = y;
-		for (unsigned int i = 0; i < pSize; i++) {
-			if (ballV[i]->alive) {
-				double dist = sqrt(pow(ballV[i]->x - x, 2.0) + pow(ballV[i]->y - y, 2.0));
-				if (dist <= rad) {
-					listParticles.push_back(i);
-					ballV[i]->stationary = true;
-				}
-			}
+		wakeCloud(x, y, rad);
+		queryResult.clear();
+		quadTree->queryCircle(x, y, rad, queryResult);
+		staticTree->queryCircle(x, y, rad, queryResult);
+		for (unsigned int i = 0; i < queryResult.size(); i++) {
+			listParticles.push_back(ballPool.handle(queryResult[i]));
+			unfixParticle(queryResult[i]);
+			queryResult[i]->stationary = true;
 		}
 		for (unsigned int j = 0; j < bhV.size(); j++) {
 			if (bhV[j].active) {
@@ -295,8 +568,11 @@ namespace z {
 		double deltaY = y - prevY;
 		if (deltaX != 0 || deltaY != 0) {
 			for (unsigned int j = 0; j < listParticles.size(); j++) {
-				ballV[listParticles[j]]->xMove += deltaX;
-				ballV[listParticles[j]]->yMove += deltaY;
+				Ball *ball = ballPool.resolve(listParticles[j]);
+				if (ball == NULL) continue;
+				if (ball->asleep) ball->wake();
+				ball->xMove += deltaX;
+				ball->yMove += deltaY;
 			}
 			for (unsigned int k = 0; k < listBH.size(); k++) {
 				bhV[listBH[k]].xMove += deltaX;
@@ -310,7 +586,8 @@ namespace z {
 	// Called after immobilizeCloud
 	void Particles::mobilizeCloud() {
 		for (unsigned int j = 0; j < listParticles.size(); j++) {
-			ballV[listParticles[j]]->stationary = false;
+			Ball *ball = ballPool.resolve(listParticles[j]);
+			if (ball != NULL) ball->stationary = false;
 		}
 		listParticles.clear();
 		listBH.clear();
@@ -318,19 +595,20 @@ namespace z {
 	
 	// Erase a spherical region of particles
 	void Particles::deactivateCloud(double x, double y, double rad) {
-		for (unsigned int i = 0; i < pSize; i++) {
-			if (ballV[i]->alive) {
-				double dist = sqrt(pow(ballV[i]->x - x, 2.0) + pow(ballV[i]->y - y, 2.0));
-				if (dist <= rad) {
-					ballV[i]->alive = false;
-				}
-			}
+		wakeCloud(x, y, rad);
+		queryResult.clear();
+		quadTree->queryCircle(x, y, rad, queryResult);
+		staticTree->queryCircle(x, y, rad, queryResult);
+		for (unsigned int i = 0; i < queryResult.size(); i++) {
+			queryResult[i]->alive = false;
 		}
+		deadParticles += queryResult.size();
 		for (unsigned int j = 1; j < bhV.size(); j++) {
 			if (bhV[j].active) {
 				double dist = sqrt(pow(bhV[j].x - x, 2.0) + pow(bhV[j].y - y, 2.0));
 				if (dist <= rad) {
 					bhV[j].active = false;
+					wakeAll();
 				}
 			}
 		}
@@ -338,19 +616,24 @@ namespace z {
 	
 	// Erase a spherical region of particles if classes match
 	void Particles::deactivateCloud(double x, double y, double rad, int diaClass, int densClass) {
-		for (unsigned int i = 0; i < pSize; i++) {
-			if (ballV[i]->alive) {
-				double dist = sqrt(pow(ballV[i]->x - x, 2.0) + pow(ballV[i]->y - y, 2.0));
-				if (dist <= rad && diaClass == ballV[i]->diameterClass && densClass == ballV[i]->densityClass) {
-					ballV[i]->alive = false;
-				}
+		wakeCloud(x, y, rad);
+		queryResult.clear();
+		quadTree->queryCircle(x, y, rad, queryResult);
+		staticTree->queryCircle(x, y, rad, queryResult);
+		int died = 0;
+		for (unsigned int i = 0; i < queryResult.size(); i++) {
+			if (queryResult[i]->materialClass == Ball::materialOf(diaClass, densClass)) {
+				queryResult[i]->alive = false;
+				died++;
 			}
 		}
+		deadParticles += died;
 		for (unsigned int j = 1; j < bhV.size(); j++) {
 			if (bhV[j].active) {
 				double dist = sqrt(pow(bhV[j].x - x, 2.0) + pow(bhV[j].y - y, 2.0));
 				if (dist <= rad) {
 					bhV[j].active = false;
+					wakeAll();
 				}
 			}
 		}
@@ -360,158 +643,763 @@ namespace z {
 	// Physics //
 	/////////////
 	
-	// Sort particles within quad tree
-	void Particles::quadSortParticles(unsigned int iStart, unsigned int iStop) {
+	// Node key of the deepest quad fully containing the particle's bounds
+	// Bounds are quantized to the bottom level grid; the common Morton prefix of the corners picks the quad
+	unsigned int Particles::quadKey(Ball *particle) {
+		particle->updateBounds();
+		const int cells = 1 << LEVELS;
+		double cellsX = cells/(quadTree->xMax - quadTree->xMin);
+		double cellsY = cells/(quadTree->yMax - quadTree->yMin);
+		// Truncation only differs from floor in (-1, 0), which clamps to 0 either way
+		unsigned int x0 = constrain(int((particle->xMin - quadTree->xMin)*cellsX), 0, cells - 1);
+		unsigned int x1 = constrain(int((particle->xMax - quadTree->xMin)*cellsX), 0, cells - 1);
+		unsigned int y0 = constrain(int((particle->yMin - quadTree->yMin)*cellsY), 0, cells - 1);
+		unsigned int y1 = constrain(int((particle->yMax - quadTree->yMin)*cellsY), 0, cells - 1);
+		
+		unsigned int level = LEVELS;
+		while (level > 0 && (x0 != x1 || y0 != y1)) {
+			x0 >>= 1;
+			x1 >>= 1;
+			y0 >>= 1;
+			y1 >>= 1;
+			level--;
+		}
+		
+		return Quad::levelOffset(level) + (spreadBits(x0) | (spreadBits(y0) << 1));
+	}
+	
+	// Interleave zeros between the low 16 bits, x in even bits and y in odd bits makes a Morton code
+	unsigned int Particles::spreadBits(unsigned int v) {
+		v &= 0x0000FFFF;
+		v = (v | (v << 8)) & 0x00FF00FF;
+		v = (v | (v << 4)) & 0x0F0F0F0F;
+		v = (v | (v << 2)) & 0x33333333;
+		v = (v | (v << 1)) & 0x55555555;
+		return v;
+	}
+	
+	// Tree rebuild, first pass: key particles and count them per node
+	void Particles::quadKeyParticles(unsigned int part, unsigned int iStart, unsigned int iStop) {
+		std::vector<unsigned int> &count = rebuildCount[part];
+		std::fill(count.begin(), count.end(), 0);
+		rebuildStart[part] = iStart;
+		rebuildStop[part] = iStop;
 		for (unsigned int i = iStart; i < iStop; i++) {
-			ballV[i]->quadResidence->sortParticle(ballV[i]);
+			if (ballV[i]->fixed) {
+				quadKeys[i] = NO_QUAD_KEY; // Stays in the static tree
+				continue;
+			}
+			quadKeys[i] = quadKey(ballV[i]);
+			count[quadKeys[i]]++;
 		}
 	}
 	
-	// Do optimized collision searching
-	void Particles::quadCollideParticles(unsigned int iStart, unsigned int iStop) {
-		if (particleCollisions) {
-			for (unsigned int i = iStart; i < iStop; i++) {
-				if (ballV[i]->alive) {
-					ballV[i]->quadResidence->collideParticles(ballV[i], true);
-				}
+	// Tree rebuild, second pass: counting sort particles by node key
+	// Call once all parts are keyed
+	void Particles::quadScatterParticles(unsigned int part, unsigned int numParts) {
+		std::vector<unsigned int> &offset = rebuildOffset[part];
+		unsigned int nodeCount = quadNodes.size();
+		unsigned int total = 0;
+		for (unsigned int k = 0; k < nodeCount; k++) {
+			if (part == 0) nodeStart[k] = total;
+			offset[k] = total;
+			for (unsigned int p = 0; p < numParts; p++) {
+				if (p < part) offset[k] += rebuildCount[p][k];
+				total += rebuildCount[p][k];
 			}
 		}
+		if (part == 0) nodeStart[nodeCount] = total;
+		
+		for (unsigned int i = rebuildStart[part]; i < rebuildStop[part]; i++) {
+			if (quadKeys[i] != NO_QUAD_KEY) quadSorted[offset[quadKeys[i]]++] = ballV[i];
+		}
 	}
-
-	void Particles::addPhysics(unsigned int iStart, unsigned int iStop) {
-		unsigned int bhVsize = bhV.size();
-		
-		// Singular physics
-		for (unsigned int i = iStart; i < iStop; i++ ) {
-			if (ballV[i]->stationary == false) {
-				// Particle-boundary collisions
-				if (boundWalls) {
-					if (ballV[i]->x > *resX - ballV[i]->radius) {
-						// Ball linear spring rate w/ wall rebound efficiency
-						ballV[i]->xVel += ((*resX - ballV[i]->radius) - ballV[i]->x)*ballV[i]->springRate*
-						((ballV[i]->xVel < 0.0) ? ballV[i]->reboundEfficiency : 1.0)*(*tickTime);
-						if (ballV[i]->x > *resX - 0.2*ballV[i]->radius && ballV[i]->xVel > 0.0) {
-							ballV[i]->xVel = -ballV[i]->xVel*ballV[i]->reboundEfficiency;
-						}
-					}
-					else if (ballV[i]->x < ballV[i]->radius) {    
-						ballV[i]->xVel += (ballV[i]->radius - ballV[i]->x)*ballV[i]->springRate*
-						((ballV[i]->xVel > 0.0) ? ballV[i]->reboundEfficiency : 1.0)*(*tickTime);
-						if (ballV[i]->x < -0.2*ballV[i]->radius && ballV[i]->xVel < 0.0) {
-							ballV[i]->xVel = -ballV[i]->xVel*ballV[i]->reboundEfficiency;
-						}
-					}
+	
+	// Tree rebuild, last pass: hand each node its range of sorted particles
+	// Call once all parts are scattered
+	void Particles::quadFillParticles(unsigned int part, unsigned int numParts) {
+		unsigned int moved = 0;
+		for (unsigned int k = part; k < quadNodes.size(); k += numParts) {
+			moved += quadFillNode(quadNodes[k]);
+		}
+		migrations += moved;
+	}
+	
+	// Returns the number of particles that changed quads
+	unsigned int Particles::quadFillNode(Quad *node) {
+		unsigned int moved = 0;
+		unsigned int k = node->nodeKey;
+		node->writingLock.lock();
+		node->residentList.assign(quadSorted.begin() + nodeStart[k], quadSorted.begin() + nodeStart[k+1]);
+		node->tooManyNulls = false;
+		node->writingLock.unlock();
+		for (unsigned int i = nodeStart[k]; i < nodeStart[k+1]; i++) {
+			if (quadSorted[i]->quadResidence != node) moved++;
+			quadSorted[i]->quadResidence = node;
+			node->setSortSlack(quadSorted[i]);
+		}
+		return moved;
+	}
+	
+	// Single threaded tree rebuild
+	void Particles::quadRebuildParticles() {
+		quadKeyParticles(0, 0, pSize);
+		quadScatterParticles(0, 1);
+		quadFillParticles(0, 1);
+	}
+	
+	//////////////////
+	// Tile Physics //
+	//////////////////
+	
+	// Work on one tile's quads (or one quad above the tiles, with recurse false)
+	// Tiles share nothing below TILE_LEVEL, so different tiles can run at once
+	
+	void Particles::setWorkers(unsigned int numWorkers) {
+		sortScratch.resize(numWorkers);
+		integrateScratch.resize(numWorkers);
+		workerStats.resize(numWorkers);
+		for (unsigned int w = 0; w < numWorkers; w++) workerStats[w].reset();
+	}
+	
+	// Sort the residents that have moved far enough
+	// Works from a copy of each list, since neighbouring tiles may be adding to it
+	void Particles::sortTile(unsigned int worker, Quad *node, bool recurse) {
+		std::vector<Ball*> &snapshot = sortScratch[worker];
+		node->writingLock.lock();
+		snapshot.assign(node->residentList.begin(), node->residentList.end());
+		node->writingLock.unlock();
+		
+		unsigned int moved = 0;
+		for (unsigned int i = 0; i < snapshot.size(); i++) {
+			Ball *ball = snapshot[i];
+			if (ball != NULL && ball->alive && !ball->asleep && ball->sortNeeded()) {
+				Quad *oldResidence = ball->quadResidence;
+				oldResidence->sortParticle(ball);
+				if (ball->quadResidence != oldResidence) moved++;
+			}
+		}
+		if (moved > 0) migrations += moved;
+		
+		if (recurse && node->level < node->maxLevel) {
+			for (unsigned int c = 0; c <= 3; c++) sortTile(worker, node->childQuad[c], true);
+		}
+	}
+	
+	// Tree rebuild, last pass for one tile
+	void Particles::fillTile(Quad *node, bool recurse) {
+		unsigned int moved = quadFillNode(node);
+		if (moved > 0) migrations += moved;
+		if (recurse && node->level < node->maxLevel) {
+			for (unsigned int c = 0; c <= 3; c++) fillTile(node->childQuad[c], true);
+		}
+	}
+	
+	// Collisions between particles inside one tile
+	void Particles::collideTile(unsigned int worker, Quad *tile) {
+		if (!particleCollisions) return;
+		tile->countAwake(); // Every sort that can reach this tile is done
+		unsigned int touching;
+		if (stepKernel & KERNEL_DYNAMIC) touching = tile->collideResidents<KERNEL_DYNAMIC>(true);
+		else if (stepKernel & KERNEL_STICKY) touching = tile->collideResidents<KERNEL_STICKY>(true);
+		else touching = tile->collideResidents<0>(true);
+		if (staticAlive > 0) {
+			if (stepKernel & KERNEL_DYNAMIC) touching += collideStaticKernel<KERNEL_DYNAMIC>(tile, true);
+			else if (stepKernel & KERNEL_STICKY) touching += collideStaticKernel<KERNEL_STICKY>(tile, true);
+			else touching += collideStaticKernel<0>(tile, true);
+		}
+		workerStats[worker].contacts += touching;
+	}
+	
+	// Collisions of the particles above the tiles, either with everything in one tile
+	// or, for a NULL tile, among themselves
+	// Every call writes to the same upper particles, so these must not run at the same time
+	void Particles::collideUpper(unsigned int worker, Quad *tile) {
+		if (!particleCollisions) return;
+		unsigned int touching;
+		if (stepKernel & KERNEL_DYNAMIC) touching = collideUpperKernel<KERNEL_DYNAMIC>(tile);
+		else if (stepKernel & KERNEL_STICKY) touching = collideUpperKernel<KERNEL_STICKY>(tile);
+		else touching = collideUpperKernel<0>(tile);
+		if (tile == NULL && staticAlive > 0) {
+			for (unsigned int k = 0; k < upperNodes.size(); k++) {
+				if (stepKernel & KERNEL_DYNAMIC) touching += collideStaticKernel<KERNEL_DYNAMIC>(upperNodes[k], false);
+				else if (stepKernel & KERNEL_STICKY) touching += collideStaticKernel<KERNEL_STICKY>(upperNodes[k], false);
+				else touching += collideStaticKernel<0>(upperNodes[k], false);
+			}
+		}
+		workerStats[worker].contacts += touching;
+	}
+	
+	// Contacts of the awake residents with the static tree
+	template <unsigned int FLAGS>
+	unsigned int Particles::collideStaticKernel(Quad *node, bool recurse) {
+		unsigned int touching = 0;
+		for (unsigned int i = 0; i < node->residentList.size(); i++) {
+			Ball *ball = node->residentList[i];
+			if (ball != NULL && ball->alive && !ball->asleep) touching += staticTree->collideStatic<FLAGS>(ball);
+		}
+		if (recurse && node->level < node->maxLevel) {
+			for (unsigned int c = 0; c <= 3; c++) touching += collideStaticKernel<FLAGS>(node->childQuad[c], true);
+		}
+		return touching;
+	}
+	
+	template <unsigned int FLAGS>
+	unsigned int Particles::collideUpperKernel(Quad *tile) {
+		unsigned int touching = 0;
+		if (tile != NULL) {
+			for (Quad *node = tile->parentQuad; node != NULL; node = node->parentQuad) {
+				for (unsigned int i = 0; i < node->residentList.size(); i++) {
+					Ball *particleA = node->residentList[i];
+					if (particleA != NULL && particleA->alive) touching += tile->collideParticles<FLAGS>(particleA, false);
 				}
-				if (ballV[i]->y > *resY - ballV[i]->radius) {
-					if (boundFloor) {
-						ballV[i]->yVel += ((*resY - ballV[i]->radius) - ballV[i]->y)*ballV[i]->springRate*
-						((ballV[i]->yVel < 0.0) ? ballV[i]->reboundEfficiency : 1.0)*(*tickTime);
-						if (ballV[i]->y > *resY - 0.2*ballV[i]->radius && ballV[i]->yVel > 0.0) {
-							ballV[i]->yVel = -ballV[i]->yVel*ballV[i]->reboundEfficiency;
-						}
-					}
+			}
+			return touching;
+		}
+		for (unsigned int k = 0; k < upperNodes.size(); k++) {
+			Quad *node = upperNodes[k];
+			for (unsigned int i = 0; i < node->residentList.size(); i++) {
+				Ball *particleA = node->residentList[i];
+				if (particleA == NULL || !particleA->alive) continue;
+				for (unsigned int j = i + 1; j < node->residentList.size(); j++) {
+					if (node->residentList[j] != NULL && node->residentList[j]->alive && collisonUpdate<FLAGS>(particleA, node->residentList[j]))
+						touching++;
 				}
-				else if (ballV[i]->y < ballV[i]->radius) {
-					if (boundCeiling) {
-						ballV[i]->yVel += (ballV[i]->radius - ballV[i]->y)*ballV[i]->springRate*
-						((ballV[i]->yVel > 0) ? ballV[i]->reboundEfficiency : 1.0)*(*tickTime);
-						if (ballV[i]->y < -0.2*ballV[i]->radius && ballV[i]->yVel < 0) {
-							ballV[i]->yVel = -ballV[i]->yVel*ballV[i]->reboundEfficiency;
-						}
+				// Upper quads below this one
+				for (unsigned int m = k + 1; m < upperNodes.size(); m++) {
+					Quad *below = upperNodes[m];
+					Quad *ancestor = below->parentQuad;
+					while (ancestor != NULL && ancestor != node) ancestor = ancestor->parentQuad;
+					if (ancestor == NULL) continue;
+					for (unsigned int j = 0; j < below->residentList.size(); j++) {
+						if (below->residentList[j] != NULL && below->residentList[j]->alive && collisonUpdate<FLAGS>(particleA, below->residentList[j]))
+							touching++;
 					}
 				}
+			}
+		}
+		return touching;
+	}
+	
+	// Integrate one tile, or the upper quads for slot tiles.size()
+	// Adds to the worker's totals and, on steps where a frame is wanted, fills the slot's vertices
+	void Particles::integrateSlot(unsigned int worker, unsigned int slot) {
+		StepStats &stats = workerStats[worker];
+		RenderTile *out = NULL;
+		if (renderStep) {
+			out = &render.back().tiles[slot];
+			out->clear();
+		}
+		
+		IntegrateKernel kernel = (stepKernel & KERNEL_DYNAMIC) ? &Particles::integrateTile<KERNEL_DYNAMIC>
+														 : integrateKernels[stepKernel%KERNEL_INTEGRATE_VARIANTS];
+		IntegrateBatch &batch = integrateScratch[worker];
+		if (slot < tiles.size()) (this->*kernel)(tiles[slot], true, stats, batch, out);
+		else {
+			for (unsigned int k = 0; k < upperNodes.size(); k++) (this->*kernel)(upperNodes[k], false, stats, batch, out);
+		}
+	}
+	
+	// Speed vn out of a surface overlapped by pen, after its spring and, once pen passes bounceDepth
+	// while still heading in, the bounce
+	// spring is the spring rate times the step; the one response for edges, walls and obstacles
+	static inline scalar surfaceResponse(scalar vn, scalar pen, scalar spring, scalar rebound, scalar bounceDepth) {
+		vn += pen*spring*((vn > 0) ? rebound : scalar(1));
+		return (pen > bounceDepth && vn < 0) ? -rebound*vn : vn;
+	}
+	
+	// Window edges and gravity for a batch of free particles
+	// Every particle takes the same path, so the loop runs several of them at a time;
+	// an edge a particle isn't touching pushes it by nothing
+	// Arrays as restrict parameters, which is where the compiler trusts they don't overlap
+	static inline void edgeBatch(unsigned int n, const scalar *__restrict__ x, const scalar *__restrict__ y,
+															 scalar *__restrict__ xVel, scalar *__restrict__ yVel, const scalar *__restrict__ radius,
+															 const scalar *__restrict__ springRate, const scalar *__restrict__ rebound,
+															 bool walls, bool floor, bool ceiling, scalar dt, scalar width, scalar height, scalar gravity) {
+		const scalar zero = 0;
+		for (unsigned int i = 0; i < n; i++) {
+			const scalar r = radius[i], spring = springRate[i]*dt, reb = rebound[i];
+			// The left wall and ceiling have always let the center past the edge before bouncing
+			const scalar farDepth = scalar(0.8)*r, nearDepth = scalar(1.2)*r;
+			scalar vx = xVel[i], vy = yVel[i];
+			if (walls) {
+				vx = -surfaceResponse(-vx, std::max(x[i] - (width - r), zero), spring, reb, farDepth);
+				vx = surfaceResponse(vx, std::max(r - x[i], zero), spring, reb, nearDepth);
+			}
+			if (floor) vy = -surfaceResponse(-vy, std::max(y[i] - (height - r), zero), spring, reb, farDepth);
+			if (ceiling) vy = surfaceResponse(vy, std::max(r - y[i], zero), spring, reb, nearDepth);
+			// Linear gravity, only clear of the floor and ceiling lines whether or not they're on
+			vy += (y[i] <= height - r && y[i] >= r) ? gravity : zero;
+			xVel[i] = vx;
+			yVel[i] = vy;
+		}
+	}
+	
+	// The move and the open boundary kill for a batch of free particles
+	// killed already holds the ones a blackhole destroyed
+	static inline void moveBatch(unsigned int n, scalar *__restrict__ x, scalar *__restrict__ y,
+															 const scalar *__restrict__ xVel, const scalar *__restrict__ yVel, const scalar *__restrict__ radius,
+															 scalar *__restrict__ killed, bool walls, bool floor, bool ceiling, scalar dt, scalar width, scalar height) {
+		const scalar zero = 0;
+		for (unsigned int i = 0; i < n; i++) {
+			const scalar r = radius[i];
+			scalar xNew = x[i] + xVel[i]*dt, yNew = y[i] + yVel[i]*dt;
+			x[i] = xNew;
+			y[i] = yNew;
+			scalar left = ((!walls && (xNew < -r || xNew > width + r)) || (!ceiling && yNew < -r) || (!floor && yNew > height + r)) ? scalar(1) : zero;
+			killed[i] = std::max(killed[i], left);
+		}
+	}
+	
+	// Speed and momentum totals of the particles in a batch still alive
+	static inline void tallyBatch(unsigned int n, const scalar *__restrict__ xVel, const scalar *__restrict__ yVel,
+																const scalar *__restrict__ mass, const scalar *__restrict__ killed, StepStats &stats) {
+		scalar maxVel = 0, energy = 0, xMomentum = 0, yMomentum = 0;
+		for (unsigned int i = 0; i < n; i++) {
+			const scalar live = scalar(1) - killed[i], m = mass[i]*live;
+			const scalar vel = xVel[i]*xVel[i] + yVel[i]*yVel[i];
+			maxVel = std::max(maxVel, vel*live);
+			energy += m*vel;
+			xMomentum += m*xVel[i];
+			yMomentum += m*yVel[i];
+		}
+		if (maxVel > stats.maxVel) stats.maxVel = maxVel;
+		stats.kineticEnergy += 0.5*energy;
+		stats.xMomentum += xMomentum;
+		stats.yMomentum += yMomentum;
+	}
+	
+	// Integrate the residents, then compact the lists while nothing else is reading them
+	// Free particles are gathered into batches and moved together
+	template <unsigned int FLAGS>
+	void Particles::integrateTile(Quad *node, bool recurse, StepStats &stats, IntegrateBatch &batch, RenderTile *out) {
+		batch.count = 0;
+		int died = gatherTile<FLAGS>(node, recurse, stats, batch, out);
+		died += integrateBatch<FLAGS>(batch, stats, out);
+		if (died > 0) deadParticles += died;
+	}
+	
+	// Sleepers are only tallied and dragged particles follow the mouse, free ones join the batch
+	// Returns the number that died
+	template <unsigned int FLAGS>
+	int Particles::gatherTile(Quad *node, bool recurse, StepStats &stats, IntegrateBatch &batch, RenderTile *out) {
+		int died = 0;
+		for (unsigned int i = 0; i < node->residentList.size(); i++) {
+			Ball *ball = node->residentList[i];
+			if (ball != NULL && ball->alive) {
+				if (ball->asleep) tallyParticle(ball, stats, out);
+				else if (ball->stationary) {
+					ball->update();
+					if (particleSleeping) ball->rest();
+					tallyParticle(ball, stats, out);
+				}
 				else {
-					// Linear gravity
-					ballV[i]->yVel += (linGravity)*(*tickTime);
+					if (batch.full()) died += integrateBatch<FLAGS>(batch, stats, out);
+					batch.add(ball);
 				}
-				
-				/*
-				if (dist < centerDist*0.2) {
-					if((ballA->x < ballB->x && ballA->xVel > ballB->xVel) ||
-						(ballA->x > ballB->x && ballA->xVel < ballB->xVel)) {
-						
-						double velocity = (ballA->xVel*ballA->mass + ballB->xVel*ballB->mass)/(ballA->mass + ballB->mass);
-						
-						ballA->xVel = velocity;
-						ballB->xVel = velocity;
+			}
+		}
+		node->cleanResidents();
+		
+		if (recurse && node->level < node->maxLevel) {
+			for (unsigned int c = 0; c <= 3; c++) died += gatherTile<FLAGS>(node->childQuad[c], true, stats, batch, out);
+		}
+		return died;
+	}
+	
+	// Move the batch, write it back and draw it, then empty it
+	// Edges and gravity, then obstacles and blackholes one particle at a time, then the move
+	// Returns the number that died
+	template <unsigned int FLAGS>
+	int Particles::integrateBatch(IntegrateBatch &batch, StepStats &stats, RenderTile *out) {
+		const bool dynamic = (FLAGS & KERNEL_DYNAMIC) != 0;
+		const bool walls = dynamic ? boundWalls : (FLAGS & KERNEL_WALLS) != 0;
+		const bool floor = dynamic ? boundFloor : (FLAGS & KERNEL_FLOOR) != 0;
+		const bool ceiling = dynamic ? boundCeiling : (FLAGS & KERNEL_CEILING) != 0;
+		const bool blackholes = dynamic || (FLAGS & KERNEL_BH) != 0;
+		const scalar dt = *tickTime;
+		edgeBatch(batch.count, batch.x, batch.y, batch.xVel, batch.yVel, batch.radius, batch.springRate, batch.reboundEfficiency,
+							walls, floor, ceiling, dt, *resX, *resY, scalar(linGravity)*dt);
+		if (!obstacles.empty() || (blackholes && !bhV.empty())) {
+			for (unsigned int i = 0; i < batch.count; i++) {
+				if (fieldForces<FLAGS>(batch.balls[i]->material(), batch.x[i], batch.y[i], batch.radius[i], batch.xVel[i], batch.yVel[i])) {
+					batch.killed[i] = 1;
+				}
+			}
+		}
+		moveBatch(batch.count, batch.x, batch.y, batch.xVel, batch.yVel, batch.radius, batch.killed,
+							walls, floor, ceiling, dt, *resX, *resY);
+		tallyBatch(batch.count, batch.xVel, batch.yVel, batch.mass, batch.killed, stats);
+		
+		int died = 0;
+		for (unsigned int i = 0; i < batch.count; i++) {
+			Ball *ball = batch.balls[i];
+			ball->x = ball->xMove = batch.x[i];
+			ball->y = ball->yMove = batch.y[i];
+			ball->xVel = batch.xVel[i];
+			ball->yVel = batch.yVel[i];
+			if (batch.killed[i] != 0) {
+				ball->alive = false;
+				died++;
+			}
+			else {
+				// Tallied as it moved, even if it falls asleep now
+				stats.alive++;
+				if (particleSleeping) {
+					ball->rest();
+					if (ball->asleep) stats.sleeping++;
+				}
+				drawParticle(ball, out);
+			}
+		}
+		batch.count = 0;
+		return died;
+	}
+	
+	// Same walk without moving anything, for when physics is paused
+	void Particles::emitTile(Quad *node, bool recurse, StepStats &stats, RenderTile *out) {
+		for (unsigned int i = 0; i < node->residentList.size(); i++) {
+			Ball *ball = node->residentList[i];
+			if (ball != NULL && ball->alive) tallyParticle(ball, stats, out);
+		}
+		
+		if (recurse && node->level < node->maxLevel) {
+			for (unsigned int c = 0; c <= 3; c++) emitTile(node->childQuad[c], true, stats, out);
+		}
+	}
+	
+	void Particles::tallyParticle(Ball *ball, StepStats &stats, RenderTile *out) {
+		stats.alive++;
+		if (ball->asleep) stats.sleeping++;
+		double vel = ball->xVel*ball->xVel + ball->yVel*ball->yVel;
+		if (vel > stats.maxVel) stats.maxVel = vel;
+		const Material &material = ball->material();
+		stats.kineticEnergy += 0.5*material.mass*vel;
+		stats.xMomentum += material.mass*ball->xVel;
+		stats.yMomentum += material.mass*ball->yVel;
+		drawParticle(ball, out);
+	}
+	
+	void Particles::drawParticle(Ball *ball, RenderTile *out) {
+		if (out != NULL) {
+			const Material &material = ball->material();
+			// Outline ring under the fill, like an inward CircleShape outline
+			if (material.innerRadius < ball->radius) out->addDisc(ball->x, ball->y, ball->radius, ball->outlineColor);
+			out->addDisc(ball->x, ball->y, material.innerRadius, ball->fillColor);
+		}
+	}
+	
+	// Combine the worker totals and start them over, only call between steps
+	void Particles::collectStats() {
+		StepStats total;
+		total.reset();
+		for (unsigned int w = 0; w < workerStats.size(); w++) {
+			StepStats &stats = workerStats[w];
+			total.alive += stats.alive;
+			if (stats.maxVel > total.maxVel) total.maxVel = stats.maxVel;
+			total.kineticEnergy += stats.kineticEnergy;
+			total.xMomentum += stats.xMomentum;
+			total.yMomentum += stats.yMomentum;
+			total.contacts += stats.contacts;
+			total.sleeping += stats.sleeping;
+			stats.reset();
+		}
+		ballAlive = total.alive + staticAlive;
+		ballSleeping = total.sleeping;
+		maxParticleVel = sqrt(total.maxVel);
+		kineticEnergy = total.kineticEnergy;
+		xMomentum = total.xMomentum;
+		yMomentum = total.yMomentum;
+		contacts = total.contacts;
+		
+		int alive = 0;
+		for (unsigned int k = 0; k < bhV.size(); k++) {
+			if (bhV[k].active) alive++;
+		}
+		bhAlive = alive;
+	}
+	
+	// Finish the frame the tiles filled this step and hand it to the draw thread
+	// Then decide whether next step fills another one; if draw hasn't taken this one yet it won't
+	void Particles::publishFrame() {
+		if (staticDirty) buildStatic();
+		if (renderStep) {
+			RenderFrame &frame = render.back();
+			frame.tiles[tiles.size() + 1] = staticTile;
+			frame.obstacles = obstacles.shape();
+			frame.stats.particles = pSize;
+			frame.stats.alive = ballAlive;
+			frame.stats.sleeping = ballSleeping;
+			frame.stats.blackholes = bhV.size();
+			frame.stats.bhAlive = bhAlive;
+			frame.stats.maxVel = maxParticleVel;
+			frame.stats.contacts = contacts;
+			frame.stats.kineticEnergy = kineticEnergy;
+			frame.stats.momentum = sqrt(xMomentum*xMomentum + yMomentum*yMomentum);
+			frame.bhShapes.clear();
+			for (unsigned int k = 0; k < bhV.size(); k++) {
+				if (bhV[k].active) frame.bhShapes.push_back(bhV[k].ballShape);
+			}
+			render.publish();
+		}
+		prepareStep();
+	}
+	
+	// Settings the next step's kernels are chosen for
+	unsigned int Particles::kernelFlags() {
+		unsigned int flags = 0;
+		if (boundWalls) flags |= KERNEL_WALLS;
+		if (boundFloor) flags |= KERNEL_FLOOR;
+		if (boundCeiling) flags |= KERNEL_CEILING;
+		if (particleStickyness) flags |= KERNEL_STICKY;
+		for (unsigned int k = 0; k < bhV.size(); k++) {
+			if (bhV[k].active) {
+				flags |= KERNEL_BH;
+				break;
+			}
+		}
+		return flags;
+	}
+	
+	// Latch what the next step does; every setting it depends on only changes between steps
+	void Particles::prepareStep() {
+		obstacles.update(*resX, *resY);
+		bhField.update(bhV, bhFieldCache, *resX, *resY);
+		renderStep = render.wanted();
+		stepKernel = kernelFlags();
+	}
+	
+	// Build a frame from the current state without stepping
+	// Used by the draw thread to show edits made while physics is parked
+	void Particles::emitFrame() {
+		RenderFrame &frame = render.back();
+		StepStats &stats = workerStats[0];
+		for (unsigned int slot = 0; slot <= tiles.size(); slot++) {
+			RenderTile *out = &frame.tiles[slot];
+			out->clear();
+			if (slot < tiles.size()) emitTile(tiles[slot], true, stats, out);
+			else {
+				for (unsigned int k = 0; k < upperNodes.size(); k++) emitTile(upperNodes[k], false, stats, out);
+			}
+		}
+		collectStats();
+		renderStep = true;
+		publishFrame();
+	}
+	
+	// One step as a graph of tile tasks: sort (or rebuild), collide, integrate
+	// A tile's collisions wait only for the sorts that can move particles into it,
+	// and a tile integrates as soon as every contact touching it is done
+	void Particles::buildStepGraph(TaskGraph &graph, bool rebuild) {
+		unsigned int numTiles = tiles.size();
+		std::vector<unsigned int> sortTask(numTiles);
+		unsigned int sortUpper;
+		
+		if (rebuild) {
+			std::vector<unsigned int> keyTask(SORT_PARTS), scatterTask(SORT_PARTS);
+			for (unsigned int p = 0; p < SORT_PARTS; p++) {
+				keyTask[p] = graph.addTask([this, p](unsigned int) {
+					unsigned int n = pSize;
+					quadKeyParticles(p, n*p/SORT_PARTS, n*(p+1)/SORT_PARTS);
+				}, PHASE_SORT);
+			}
+			for (unsigned int p = 0; p < SORT_PARTS; p++) {
+				scatterTask[p] = graph.addTask([this, p](unsigned int) {
+					quadScatterParticles(p, SORT_PARTS);
+				}, PHASE_SORT);
+				for (unsigned int q = 0; q < SORT_PARTS; q++) graph.addDependency(keyTask[q], scatterTask[p]);
+			}
+			for (unsigned int t = 0; t < numTiles; t++) {
+				sortTask[t] = graph.addTask([this, t](unsigned int) {
+					fillTile(tiles[t], true);
+				}, PHASE_SORT);
+			}
+			sortUpper = graph.addTask([this](unsigned int) {
+				for (unsigned int k = 0; k < upperNodes.size(); k++) fillTile(upperNodes[k], false);
+			}, PHASE_SORT);
+			for (unsigned int p = 0; p < SORT_PARTS; p++) {
+				for (unsigned int t = 0; t < numTiles; t++) graph.addDependency(scatterTask[p], sortTask[t]);
+				graph.addDependency(scatterTask[p], sortUpper);
+			}
+		}
+		else {
+			for (unsigned int t = 0; t < numTiles; t++) {
+				sortTask[t] = graph.addTask([this, t](unsigned int worker) {
+					sortTile(worker, tiles[t], true);
+				}, PHASE_SORT);
+			}
+			sortUpper = graph.addTask([this](unsigned int worker) {
+				for (unsigned int k = 0; k < upperNodes.size(); k++) sortTile(worker, upperNodes[k], false);
+			}, PHASE_SORT);
+		}
+		
+		std::vector<unsigned int> collideTask(numTiles);
+		for (unsigned int t = 0; t < numTiles; t++) {
+			collideTask[t] = graph.addTask([this, t](unsigned int worker) {
+				collideTile(worker, tiles[t]);
+			}, PHASE_COLLIDE);
+			graph.addDependency(sortTask[t], collideTask[t]);
+			if (!rebuild) {
+				// Trickled particles only reach a tile from its neighbours or from above
+				graph.addDependency(sortUpper, collideTask[t]);
+				for (unsigned int u = 0; u < numTiles; u++) {
+					if (u != t && tiles[u]->xMin <= tiles[t]->xMax && tiles[t]->xMin <= tiles[u]->xMax &&
+							tiles[u]->yMin <= tiles[t]->yMax && tiles[t]->yMin <= tiles[u]->yMax) {
+						graph.addDependency(sortTask[u], collideTask[t]);
 					}
-					if((ballA->y < ballB->y && ballA->yVel > ballB->yVel) ||
-						(ballA->y > ballB->y && ballA->yVel < ballB->yVel)) {
-						
-						double velocity = (ballA->yVel*ballA->mass + ballB->yVel*ballB->mass)/(ballA->mass + ballB->mass);
-						
-						ballA->yVel = velocity;
-						ballB->yVel = velocity;
-					}									
 				}
-				*/
-				
-				// Black hole effects
-				for (unsigned int k = 0; k < bhVsize; k++) {
-					if (bhV[k].active == true) {
-						double term = 0;
-						double dist = sqrt(pow(ballV[i]->x - bhV[k].x, 2.f) + pow(ballV[i]->y - bhV[k].y, 2.f));
-						if (bhV[k].interact == COLLISION && dist < ballV[i]->radius + bhV[k].radius) { 
-							term = ballV[i]->springRate*(ballV[i]->radius + bhV[k].radius - dist)*(*tickTime);
-							
-							ballV[i]->xVel += ((ballV[i]->x - bhV[k].x)/dist)*term;
-							ballV[i]->yVel += ((ballV[i]->y - bhV[k].y)/dist)*term;
+			}
+		}
+		
+		// Particles above the tiles collide among themselves, then with one tile at a time
+		// These all write to the same upper particles, so they run as a chain
+		unsigned int upperTask = graph.addTask([this](unsigned int worker) {
+			collideUpper(worker, NULL);
+		}, PHASE_COLLIDE);
+		for (unsigned int t = 0; t < numTiles; t++) graph.addDependency(sortTask[t], upperTask);
+		graph.addDependency(sortUpper, upperTask);
+		unsigned int previous = upperTask;
+		for (unsigned int t = 0; t < numTiles; t++) {
+			unsigned int linkTask = graph.addTask([this, t](unsigned int worker) {
+				collideUpper(worker, tiles[t]);
+			}, PHASE_COLLIDE);
+			graph.addDependency(previous, linkTask);
+			graph.addDependency(collideTask[t], linkTask);
+			unsigned int integrateTask = graph.addTask([this, t](unsigned int worker) {
+				integrateSlot(worker, t);
+			}, PHASE_INTEGRATE);
+			graph.addDependency(linkTask, integrateTask);
+			previous = linkTask;
+		}
+		unsigned int integrateUpper = graph.addTask([this, numTiles](unsigned int worker) {
+			integrateSlot(worker, numTiles);
+		}, PHASE_INTEGRATE);
+		graph.addDependency(previous, integrateUpper);
+	}
+
+	// Obstacles and blackholes, the forces that differ from particle to particle
+	// Returns true if a blackhole destroyed the particle
+	template <unsigned int FLAGS>
+	bool Particles::fieldForces(const Material &material, scalar x, scalar y, scalar radius, scalar &xVel, scalar &yVel) {
+		const bool dynamic = (FLAGS & KERNEL_DYNAMIC) != 0;
+		const bool blackholes = dynamic || (FLAGS & KERNEL_BH) != 0;
+		unsigned int bhVsize = blackholes ? bhV.size() : 0;
+		const scalar dt = *tickTime;
+		bool destroyed = false;
+		
+		// Obstacles, whichever one is nearest
+		scalar gap, nx, ny;
+		if (obstacles.contact(x, y, radius, gap, nx, ny)) surfaceContact(material, radius, radius - gap, nx, ny, xVel, yVel);
+		
+		// Black hole effects
+		// Away from the still ones their pull comes from the field, the rest are evaluated here
+		bool fromField = false;
+		if (bhVsize > 0 && !bhField.empty()) {
+			scalar ax, ay;
+			if (bhField.sample(x, y, ax, ay)) {
+				xVel += ax*dt;
+				yVel += ay*dt;
+				fromField = true;
+			}
+		}
+		for (unsigned int k = 0; k < bhVsize; k++) {
+			if (bhV[k].active == true && !(fromField && bhField.holds(k))) {
+				scalar term = 0;
+				scalar dx = x - bhV[k].x, dy = y - bhV[k].y;
+				scalar dist = std::sqrt(dx*dx + dy*dy);
+				if (bhV[k].interact == COLLISION && dist < radius + bhV[k].radius) { 
+					term = material.springRate*(radius + bhV[k].radius - dist)*dt;
+					
+					xVel += (dx/dist)*term;
+					yVel += (dy/dist)*term;
+				}
+				else {
+					if (dist > bhV[k].radius) {
+						term = (bhV[k].centerAccel/(dist*dist))*dt;
+					}
+					else {
+						if (bhV[k].interact == DESTRUCTION){
+							destroyed = true;
 						}
 						else {
-							if (dist > bhV[k].radius) {
-								term = (bhV[k].centerAccel/pow(dist, 2))*(*tickTime);
-							}
-							else {
-								if (bhV[k].interact == DESTRUCTION){
-									ballV[i]->alive = false;
-								}
-								else {
-									term = bhV[k].surfaceAccel*(*tickTime);
-								}
-							}
-
-							ballV[i]->xVel += ((bhV[k].x - ballV[i]->x)/dist)*term;
-							ballV[i]->yVel += ((bhV[k].y - ballV[i]->y)/dist)*term;
+							term = bhV[k].surfaceAccel*dt;
 						}
 					}
+
+					xVel -= (dx/dist)*term;
+					yVel -= (dy/dist)*term;
 				}
 			}
-		
-			ballV[i]->update();
 		}
-		if (iStart == 0) {
-			for (unsigned int k = 0; k < bhVsize; k++) {
-				bhV[k].update();
+		return destroyed;
+	}
+	
+	// Spring response against a surface overlapped by pen, along the unit normal (nx, ny) out of it
+	void Particles::surfaceContact(const Material &material, scalar radius, scalar pen, scalar nx, scalar ny, scalar &xVel, scalar &yVel) {
+		scalar vn = xVel*nx + yVel*ny;
+		scalar change = surfaceResponse(vn, pen, material.springRate*(*tickTime), material.reboundEfficiency, scalar(0.8)*radius) - vn;
+		xVel += nx*change;
+		yVel += ny*change;
+	}
+	
+	void Particles::moveBH() {
+		for (unsigned int k = 0; k < bhV.size(); k++) {
+			scalar x = bhV[k].x, y = bhV[k].y;
+			bhV[k].update();
+			if (bhV[k].active && (std::fabs(bhV[k].x - x) > SLEEP_BH_MOVE || std::fabs(bhV[k].y - y) > SLEEP_BH_MOVE)) {
+				wakeCloud(bhV[k].x, bhV[k].y, bhV[k].radius);
+				bhV[k].stillSteps = 0;
 			}
+			else if (bhV[k].stillSteps < FIELD_STILL) bhV[k].stillSteps++;
 		}
 	}
 	
 	// Assumes that particleCollisions and both balls are alive
-	void Particles::collisonUpdate(Ball *ballA, Ball *ballB) {
+	// Touching particles share the shorter rest, so a pile only sleeps once all of it is still
+	// A sleeper holds still against particles settling onto it, but wakes if a moving one reaches it
+	template <unsigned int FLAGS>
+	bool Particles::collisonUpdate(Ball *ballA, Ball *ballB) {
+		if (!ballA->asleep && !ballB->asleep) {
+			bool touching = contactUpdate<FLAGS>(ballA, ballB);
+			if (touching && particleSleeping) ballA->restSteps = ballB->restSteps = std::min(ballA->restSteps, ballB->restSteps);
+			return touching;
+		}
+		if (ballA->asleep && ballB->asleep) return false;
+		Ball *sleeper = ballA->asleep ? ballA : ballB;
+		Ball *mover = ballA->asleep ? ballB : ballA;
+		bool touching = contactUpdate<FLAGS>(ballA, ballB);
+		if (touching && mover->restSteps < SLEEP_WAKE_STEPS) sleeper->wake();
+		else sleeper->xVel = sleeper->yVel = 0;
+		return touching;
+	}
+	
+	// The contact itself, whatever the particles' sleep
+	template <unsigned int FLAGS>
+	bool Particles::contactUpdate(Ball *ballA, Ball *ballB) {
+		const bool sticky = (FLAGS & KERNEL_DYNAMIC) ? particleStickyness : (FLAGS & KERNEL_STICKY) != 0;
+		const MaterialPair &pair = ballA->pairWith(ballB);
+		const scalar dt = *tickTime;
 		
 		// Distance between the two points
-		double dist = sqrt(pow(ballA->x - ballB->x, 2.0) + pow(ballA->y - ballB->y, 2.0));
-		if (dist == 0) dist = 0.01; // Remove divide by zero errors
-		
-		double centerDist = ballA->radius + ballB->radius;
-		
+		scalar dx = ballA->x - ballB->x, dy = ballA->y - ballB->y;
+		scalar dist = std::sqrt(dx*dx + dy*dy);
+		if (dist == 0) dist = scalar(0.01); // Remove divide by zero errors
 		
 		// Check for particle collision
-		if (dist < centerDist) { 
+		if (dist < pair.centerDist) { 
 			//double force = ((ballA->springRate + ballB->springRate)/2.f)
 			//							*(centerDist - dist)*(*tickTime);
-			double force = ((ballA->springRate <= ballB->springRate) ? ballA->springRate : ballB->springRate)
-										*(centerDist - dist)*(*tickTime);
-			double forceVect;
+			scalar force = pair.stiffness*(pair.centerDist - dist)*dt;
+			scalar forceVect;
 			
 			// If ball centers collide, then average their momentum in an inelastic collision
 			//(((ballA->x < ballB->x && ballA->xVel < ballB->xVel) ||
 			//		(ballA->x > ballB->x && ballA->xVel > ballB->xVel))
-			if (dist < centerDist*0.2) {
+			if (dist < pair.centerDist*scalar(0.2)) {
 				if((ballA->x < ballB->x && ballA->xVel > ballB->xVel) ||
 					(ballA->x > ballB->x && ballA->xVel < ballB->xVel)) {
 					
-					double velocity = (ballA->xVel*ballA->mass + ballB->xVel*ballB->mass)/(ballA->mass + ballB->mass);
+					scalar velocity = ballA->xVel*pair.shareA + ballB->xVel*pair.shareB;
 					
 					ballA->xVel = velocity;
 					ballB->xVel = velocity;
@@ -519,7 +1407,7 @@ namespace z {
 				if((ballA->y < ballB->y && ballA->yVel > ballB->yVel) ||
 					(ballA->y > ballB->y && ballA->yVel < ballB->yVel)) {
 					
-					double velocity = (ballA->yVel*ballA->mass + ballB->yVel*ballB->mass)/(ballA->mass + ballB->mass);
+					scalar velocity = ballA->yVel*pair.shareA + ballB->yVel*pair.shareB;
 					
 					ballA->yVel = velocity;
 					ballB->yVel = velocity;
@@ -527,71 +1415,124 @@ namespace z {
 			}
 			forceVect = ((ballA->x - ballB->x)/dist)*force*
 				(((ballA->x < ballB->x && ballA->xVel < ballB->xVel) ||
-				(ballA->x > ballB->x && ballA->xVel > ballB->xVel)) ? ballA->reboundEfficiency : 1.0);
-			ballA->xVel += forceVect/ballA->mass;
-			ballB->xVel -= forceVect/ballB->mass;
+				(ballA->x > ballB->x && ballA->xVel > ballB->xVel)) ? pair.reboundEfficiency : scalar(1));
+			ballA->xVel += forceVect*pair.invMassA;
+			ballB->xVel -= forceVect*pair.invMassB;
 			forceVect = ((ballA->y - ballB->y)/dist)*force*
 				(((ballA->y < ballB->y && ballA->yVel < ballB->yVel) ||
-				(ballA->y > ballB->y && ballA->yVel > ballB->yVel)) ? ballA->reboundEfficiency : 1.0);
-			ballA->yVel += forceVect/ballA->mass;
-			ballB->yVel -= forceVect/ballB->mass;
+				(ballA->y > ballB->y && ballA->yVel > ballB->yVel)) ? pair.reboundEfficiency : scalar(1));
+			ballA->yVel += forceVect*pair.invMassA;
+			ballB->yVel -= forceVect*pair.invMassB;
+			return true;
 		}
-		else if (particleStickyness && dist < centerDist + std::max(ballA->attrRad, ballB->attrRad)) {
-			
-			// Figure out which attraction rates to use
-			double attractRate = 0;
-			if (dist < centerDist + ballA->attrRad) {
-				attractRate += ballA->attrRate;
-			}
-			if (dist < centerDist + ballA->attrRad) {
-				attractRate += ballB->attrRate;
-			}
-			
-			double force = attractRate*(*tickTime)/std::pow(dist, 2.f);
-			double forceVect;
+		else if (sticky && dist < pair.attrReach) {
+			scalar force = pair.attraction*dt/(dist*dist);
+			scalar forceVect;
 			
 			forceVect = ((ballA->x - ballB->x)/dist)*force;
-			ballA->xVel -= forceVect/ballA->mass;
-			ballB->xVel += forceVect/ballB->mass;
+			ballA->xVel -= forceVect*pair.invMassA;
+			ballB->xVel += forceVect*pair.invMassB;
 			forceVect = ((ballA->y - ballB->y)/dist)*force;
-			ballA->yVel -= forceVect/ballA->mass;
-			ballB->yVel += forceVect/ballB->mass;
+			ballA->yVel -= forceVect*pair.invMassA;
+			ballB->yVel += forceVect*pair.invMassB;
 		}
+		return false;
 	}
 	
-	void Particles::draw(sf::RenderWindow* mainWindow) {
-		int tempCount = 0;
-		double maxVel = 0;
-		double vel;
+	// One-sided contact with a fixed particle, which never moves and is shared between tiles
+	// Same forces as contactUpdate against a particle at rest, whose momentum can't be averaged with
+	template <unsigned int FLAGS>
+	bool Particles::staticUpdate(Ball *ball, const Ball *wall) {
+		const bool sticky = (FLAGS & KERNEL_DYNAMIC) ? particleStickyness : (FLAGS & KERNEL_STICKY) != 0;
+		const MaterialPair &pair = ball->pairWith(wall);
+		const scalar dt = *tickTime;
 		
-		unsigned int bVsize = pSize;
-		unsigned int bhVsize = bhV.size();
+		scalar dx = ball->x - wall->x, dy = ball->y - wall->y;
+		scalar dist = std::sqrt(dx*dx + dy*dy);
+		if (dist == 0) dist = scalar(0.01); // Remove divide by zero errors
 		
-		// Draw all particles in ball vector
-		for (unsigned int i = 0; i < bVsize; i++ ) {
-			if (ballV[i]->alive) {
-				tempCount++;
-				vel = sqrt(pow(ballV[i]->xVel, 2.0) + pow(ballV[i]->yVel, 2.0));
-				if (vel > maxVel) maxVel = vel;
-				mainWindow->draw(ballV[i]->ballShape);
+		if (dist < pair.centerDist) {
+			scalar force = pair.stiffness*(pair.centerDist - dist)*dt;
+			
+			// Centres nearly overlapping, stop closing in on it
+			if (dist < pair.centerDist*scalar(0.2)) {
+				if (dx*ball->xVel < 0) ball->xVel = 0;
+				if (dy*ball->yVel < 0) ball->yVel = 0;
 			}
+			// Moving away from it, so rebound efficiency applies
+			ball->xVel += (dx/dist)*force*((dx*ball->xVel > 0) ? pair.reboundEfficiency : scalar(1))*pair.invMassA;
+			ball->yVel += (dy/dist)*force*((dy*ball->yVel > 0) ? pair.reboundEfficiency : scalar(1))*pair.invMassA;
+			return true;
 		}
-		ballAlive = tempCount;
-		if (bVsize - ballAlive >= PARTICLE_CLEAN && bVsize - PARTICLE_CLEAN > 50) cleanParticles();
-		
-		maxParticleVel = maxVel;
-		
-		tempCount = 0;
-		for (unsigned int i = 0; i < bhVsize; i++ ) {
-			if (bhV[i].active) {
-				//std::cout << "yes\n";
-				tempCount++;
-				mainWindow->draw(bhV[i].ballShape);
+		else if (sticky && dist < pair.attrReach) {
+			scalar force = pair.attraction*dt/(dist*dist);
+			ball->xVel -= (dx/dist)*force*pair.invMassA;
+			ball->yVel -= (dy/dist)*force*pair.invMassA;
+		}
+		return false;
+	}
+	
+	template bool Particles::collisonUpdate<0>(Ball*, Ball*);
+	template bool Particles::collisonUpdate<KERNEL_STICKY>(Ball*, Ball*);
+	template bool Particles::collisonUpdate<KERNEL_DYNAMIC>(Ball*, Ball*);
+	template bool Particles::staticUpdate<0>(Ball*, const Ball*);
+	template bool Particles::staticUpdate<KERNEL_STICKY>(Ball*, const Ball*);
+	template bool Particles::staticUpdate<KERNEL_DYNAMIC>(Ball*, const Ball*);
+	
+	// Only uploads what the workers prepared, never touches ballV or bhV
+	// Dump every particle and the tree, only call between steps
+	void Particles::printParticles() {
+		for (unsigned int i = 0; i < pSize; i++) {
+			Ball *ball = ballV[i];
+			std::cout << "Particle " << ball->id << ": ";
+			if (ball->alive) {
+				std::cout << "Vel = " << sqrt(pow(ball->xVel, 2.0) + pow(ball->yVel, 2.0));
+				std::cout <<", x = " << ball->x << ", y = " << ball->y << "\n\tLevel: ";
+				std::cout << ball->quadResidence->level << ", ChildNum: " << ball->quadResidence->childNum;
+				std::cout	<< ", xMin, xMax, yMin, yMax: " << ball->quadResidence->xMin << "," << ball->quadResidence->xMax << "," << ball->quadResidence->yMin << "," << ball->quadResidence->yMax << "\n";
+				ball->updateBounds();
+				std::cout << "\t\t\txMin, xMax, yMin, yMax: " << ball->xMin << "\t" << ball->xMax << "\t" << ball->yMin << "\t" << ball->yMax << "\n";
+				std::cout << "\t\tBall points to Quad Residence: " << ((ball->quadResidence->checkIfResident(ball->id, false))?"True":"False") << "\n";
+			}
+			else {
+				std::cout << "Inactive\n";
 			}
 		}
-		bhAlive = tempCount;
-		if (bhVsize - bhAlive >= BH_CLEAN && bhVsize - BH_CLEAN > 1) cleanBH();
-
+		std::cout << "\n";
+		quadTree->printParams();
+		std::cout << "\n";
+	}
+	
+	void Particles::draw(sf::RenderWindow* mainWindow) {
+		if (!discReady) {
+			// White disc with a soft edge, tinted per vertex
+			sf::Image disc;
+			disc.create(DISC_TEXTURE_SIZE, DISC_TEXTURE_SIZE, sf::Color(255, 255, 255, 0));
+			double half = DISC_TEXTURE_SIZE/2.0;
+			for (unsigned int px = 0; px < DISC_TEXTURE_SIZE; px++) {
+				for (unsigned int py = 0; py < DISC_TEXTURE_SIZE; py++) {
+					double dist = sqrt(pow(px + 0.5 - half, 2.0) + pow(py + 0.5 - half, 2.0));
+					double alpha = constrain(half - dist, 0.0, 1.0);
+					disc.setPixel(px, py, sf::Color(255, 255, 255, alpha*255));
+				}
+			}
+			discTexture.loadFromImage(disc);
+			discTexture.setSmooth(true);
+			discReady = true;
+		}
+		
+		render.acquire();
+		RenderFrame &frame = render.front();
+		if (!frame.obstacles.empty()) mainWindow->draw(&frame.obstacles[0], frame.obstacles.size(), sf::Triangles);
+		sf::RenderStates states(&discTexture);
+		for (unsigned int t = 0; t < frame.tiles.size(); t++) {
+			RenderTile &tile = frame.tiles[t];
+			if (tile.vertices.empty() || tile.xMax < 0 || tile.xMin > *resX || tile.yMax < 0 || tile.yMin > *resY) continue;
+			mainWindow->draw(&tile.vertices[0], tile.vertices.size(), sf::Quads, states);
+		}
+		for (unsigned int k = 0; k < frame.bhShapes.size(); k++) {
+			mainWindow->draw(frame.bhShapes[k]);
+		}
 	}
 
 }
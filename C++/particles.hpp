@@ -3,29 +3,128 @@
 
 #include <cmath>
 #include <vector>
+#include <algorithm>
+#include <atomic>
+#include <string>
 
 #include "blackHole.hpp"
 #include "quad.hpp"
 #include "ball.hpp"
+#include "ballPool.hpp"
+#include "commandQueue.hpp"
+#include "obstacles.hpp"
+#include "forceField.hpp"
+#include "renderFrame.hpp"
+#include "rng.hpp"
+#include "taskGraph.hpp"
 
-#define NUM_TRIES 25
 #define PI 3.14159265359
 #define PI2 6.28318530718
 #define PI60 1.04719755
 
 #define MAX_PARTICLES 10000
 #define MAX_BH 1000
-#define PARTICLE_CLEAN 500
 #define BH_CLEAN 10
+#define REORDER_DRIFT 0.25 // Fraction of particles changing quads before ballV is put back in Z-order
 
 #define LEVELS 4
+#define SORT_PARTS 4 // Number of tasks sharing a tree rebuild
+#define TILE_LEVEL 2 // Quads at this level are the units of work for the step scheduler
+#define KERNEL_INTEGRATE_VARIANTS 16 // Every combination of the flags below KERNEL_STICKY
+#define INTEGRATE_BATCH 64 // Free particles integrated together
+#define SLEEP_WAKE_MARGIN 40.0 // Sleepers this far outside an edit are woken along with the ones inside it
+#define SLEEP_BH_MOVE 0.01 // Blackholes moving further than this in a step wake the sleepers near them
+#define NO_QUAD_KEY 0xFFFFFFFF // Key of particles the tree rebuild leaves out
 
 namespace z {
 
+// Parts of a step, as counted by PhaseCounters
+enum StepPhase {
+	PHASE_SORT,
+	PHASE_COLLIDE,
+	PHASE_INTEGRATE,
+	PHASE_BOUNDARY, // Worker 0 alone, between steps
+	PHASE_COUNT
+};
+
+static inline std::vector<std::string> stepPhaseNames() {
+	std::vector<std::string> names;
+	names.push_back("sort");
+	names.push_back("collide");
+	names.push_back("integrate");
+	names.push_back("boundary");
+	return names;
+}
+
+// Settings the step kernels are compiled for, so their inner loops don't test them
+// Chosen once per step; the pre-instantiated variants cover every combination
+enum KernelFlags {
+	KERNEL_WALLS = 1,
+	KERNEL_FLOOR = 2,
+	KERNEL_CEILING = 4,
+	KERNEL_BH = 8, // Any active blackhole
+	KERNEL_STICKY = 16, // Only changes collisions
+	KERNEL_DYNAMIC = 32 // Test the settings as it goes instead, for paths not worth specialising
+};
+
+// One worker's share of the step totals, combined between steps
+struct StepStats {
+	int alive;
+	double maxVel; // Squared until combined
+	double kineticEnergy;
+	double xMomentum, yMomentum;
+	unsigned int contacts;
+	int sleeping;
+	char pad[64]; // Keep neighbouring workers' totals off the same cache line
+	
+	void reset() {
+		alive = 0;
+		maxVel = kineticEnergy = xMomentum = yMomentum = 0;
+		contacts = 0;
+		sleeping = 0;
+	}
+};
+
+// Free particles side by side, for the integrate kernel
+// Gathered from the tree and written back a batch at a time, small enough that
+// the particles are still in cache when they're written back
+struct IntegrateBatch {
+	unsigned int count;
+	Ball *balls[INTEGRATE_BATCH];
+	scalar x[INTEGRATE_BATCH], y[INTEGRATE_BATCH];
+	scalar xVel[INTEGRATE_BATCH], yVel[INTEGRATE_BATCH];
+	scalar radius[INTEGRATE_BATCH], springRate[INTEGRATE_BATCH], reboundEfficiency[INTEGRATE_BATCH], mass[INTEGRATE_BATCH];
+	scalar killed[INTEGRATE_BATCH]; // 1 if it left through an open edge or a blackhole destroyed it; as wide as the rest, which keeps the kernel vectorised
+	
+	IntegrateBatch() {
+		count = 0;
+	}
+	
+	bool full() const {
+		return count == INTEGRATE_BATCH;
+	}
+	
+	void add(Ball *ball) {
+		const Material &material = ball->material();
+		balls[count] = ball;
+		x[count] = ball->x;
+		y[count] = ball->y;
+		xVel[count] = ball->xVel;
+		yVel[count] = ball->yVel;
+		radius[count] = ball->radius;
+		springRate[count] = material.springRate;
+		reboundEfficiency[count] = material.reboundEfficiency;
+		mass[count] = material.mass;
+		killed[count] = 0;
+		count++;
+	}
+};
+
 class Particles {
 //private:
 public:
 	Quad* quadTree;
+	Quad* staticTree; // Fixed particles, only changed by edits between steps
 
 //public:
 	int *resX, *resY;
@@ -36,34 +135,89 @@ public:
 	bool boundCeiling;
 	bool boundWalls;
 	bool boundFloor;
+	bool quadRebuild; // Rebuild tree from scratch each step instead of trickling
+	bool particleSleeping; // Resting groups of particles drop out of the step until disturbed
+	bool bhFieldCache; // Blackholes holding still are read from a baked field instead of evaluated per particle
 		
 	double prevX;
 	double prevY;
 	
+	Rng rng; // Only used while creating particles, which happens on one thread at a time
+	BallPool ballPool;
 	std::vector<z::Ball*> ballV;
 	std::vector<z::BlackHole> bhV;
 	
-	std::vector<int> listParticles;
+	std::vector<BallHandle> listParticles;
+	std::vector<Ball*> queryResult;
 	std::vector<int> listBH;
 	
+	CommandQueue commands; // Edits from the draw thread, applied between steps
+	std::atomic<int> deadParticles; // Killed but not yet compacted out of ballV
+	std::atomic<unsigned int> migrations; // Particles that changed quads since the last reorder
+	std::vector<std::pair<unsigned int, int> > reorderKeys;
+	std::vector<Ball*> reorderV;
+	
 	int ballAlive;
+	int ballSleeping;
+	int staticAlive; // Counted when the static tree last changed
 	int bhAlive;
 	
 	unsigned int pSize;
 	
+	// Totals from the last step
 	double maxParticleVel;
+	double kineticEnergy;
+	double xMomentum, yMomentum;
+	unsigned int contacts;
+	
+	// Tree rebuild
+	std::vector<Quad*> quadNodes;
+	std::vector<unsigned int> quadKeys;
+	std::vector<Ball*> quadSorted;
+	std::vector<unsigned int> nodeStart;
+	std::vector<unsigned int> rebuildCount[SORT_PARTS];
+	std::vector<unsigned int> rebuildOffset[SORT_PARTS];
+	unsigned int rebuildStart[SORT_PARTS], rebuildStop[SORT_PARTS];
+	
+	// Tiles
+	std::vector<Quad*> tiles; // Quads at TILE_LEVEL
+	std::vector<Quad*> upperNodes; // Quads above TILE_LEVEL, parents first
+	std::vector<std::vector<Ball*> > sortScratch; // Per worker
+	std::vector<StepStats> workerStats;
+	std::vector<IntegrateBatch> integrateScratch; // Per worker
+	
+	// Kernels
+	typedef void (Particles::*IntegrateKernel)(Quad*, bool, StepStats&, IntegrateBatch&, RenderTile*);
+	IntegrateKernel integrateKernels[KERNEL_INTEGRATE_VARIANTS]; // integrateTile for each combination of flags
+	unsigned int stepKernel; // KernelFlags for the next step, latched between steps
+	
+	// Static particles
+	bool staticDirty; // Fixed particles were added or removed since the tree was last tidied
+	RenderTile staticTile; // Their vertices, copied into each frame
+	
+	// Obstacles
+	ObstacleField obstacles; // Walls and outlines, rebaked between steps when edited
+	std::vector<double> outlineX, outlineY; // Corners of an outline still arriving through the queue
+	
+	// Blackholes
+	ForceField bhField; // Pull of the still ones, rebaked between steps when one changes
+	
+	// Drawing
+	RenderPipeline render;
+	bool renderStep; // Emit vertices this step, latched between steps
+	sf::Texture discTexture;
+	bool discReady;
 	
 	/////////////////
 	// Constructor //
 	/////////////////
 	Particles(int *resXT, int *resYT, double *tickTimeT, double linGravityT);
 	~Particles() {
-		for (unsigned int k = 0; k < ballV.size(); k++) delete ballV[k];
-		delete quadTree;
+		delete quadTree; // Balls are freed with the pool
+		delete staticTree;
 	}
 	inline double randDouble(double minimum, double maximum) {
-		double r = (double)rand()/(double)RAND_MAX;
-		return minimum + r*(maximum - minimum);
+		return rng.nextDouble(minimum, maximum);
 	}
 	
 	///////////////////////
@@ -71,12 +225,23 @@ public:
 	///////////////////////
 	void createInitBalls(unsigned int, int, int);
 	void createCloud(double, double, double, double, double, int, int, bool, bool);
-	int createParticle(double, double, double, double, int, int, bool, bool);
+	bool createParticle(double, double, double, double, int, int, bool, bool, BallHandle&);
 	///////////////////////////
 	// Particle Manipulation //
 	///////////////////////////
 	void createBH(int, int, double, int, InteractionSetting);
+	void fixParticle(Ball*);
+	void unfixParticle(Ball*);
+	void buildStatic();
+	void setStickyness(bool);
+	void setSleeping(bool);
+	void wakeAll();
+	void wakeCloud(double, double, double);
+	bool applyCommands();
 	void cleanParticles();
+	void reorderParticles();
+	bool maintenanceDue();
+	void maintainParticles();
 	void cleanBH();
 	void cleanQuad();
 	void zeroVel();
@@ -90,12 +255,44 @@ public:
 	/////////////
 	// Physics //
 	/////////////
-	void quadSortParticles(unsigned int, unsigned int);
-	void quadCollideParticles(unsigned int, unsigned int);
-	void addPhysics(unsigned int, unsigned int);
+	unsigned int quadKey(Ball*);
+	void quadKeyParticles(unsigned int, unsigned int, unsigned int);
+	void quadScatterParticles(unsigned int, unsigned int);
+	void quadFillParticles(unsigned int, unsigned int);
+	unsigned int quadFillNode(Quad*);
+	void quadRebuildParticles();
+	static unsigned int spreadBits(unsigned int);
+	template <unsigned int FLAGS> bool fieldForces(const Material&, scalar, scalar, scalar, scalar&, scalar&);
+	void surfaceContact(const Material&, scalar, scalar, scalar, scalar, scalar&, scalar&);
+	void moveBH();
+	
+	void setWorkers(unsigned int);
+	void sortTile(unsigned int, Quad*, bool);
+	void fillTile(Quad*, bool);
+	void collideTile(unsigned int, Quad*);
+	void collideUpper(unsigned int, Quad*);
+	template <unsigned int FLAGS> unsigned int collideUpperKernel(Quad*);
+	template <unsigned int FLAGS> unsigned int collideStaticKernel(Quad*, bool);
+	void integrateSlot(unsigned int, unsigned int);
+	template <unsigned int FLAGS> void integrateTile(Quad*, bool, StepStats&, IntegrateBatch&, RenderTile*);
+	template <unsigned int FLAGS> int gatherTile(Quad*, bool, StepStats&, IntegrateBatch&, RenderTile*);
+	template <unsigned int FLAGS> int integrateBatch(IntegrateBatch&, StepStats&, RenderTile*);
+	void emitTile(Quad*, bool, StepStats&, RenderTile*);
+	void tallyParticle(Ball*, StepStats&, RenderTile*);
+	void drawParticle(Ball*, RenderTile*);
+	void buildStepGraph(TaskGraph&, bool);
+	void collectStats();
+	void publishFrame();
+	void emitFrame();
+	unsigned int kernelFlags();
+	void prepareStep();
 	
 	// Assumes that particleCollisions and both balls are alive
-	void collisonUpdate(Ball*, Ball*);
+	// Returns true if they touch
+	template <unsigned int FLAGS> bool collisonUpdate(Ball*, Ball*);
+	template <unsigned int FLAGS> bool contactUpdate(Ball*, Ball*);
+	template <unsigned int FLAGS> bool staticUpdate(Ball*, const Ball*);
+	void printParticles();
 	void draw(sf::RenderWindow*);
 };
 
@@ -0,0 +1,249 @@
+#ifndef PERF_COUNTERS_HPP
+#define PERF_COUNTERS_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#define PERF_MAX_PHASES 8
+
+namespace z {
+
+enum PerfEvent {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_L1_MISSES,
+	PERF_LLC_MISSES,
+	PERF_BRANCH_MISSES,
+	PERF_EVENT_COUNT,
+	PERF_CACHE_MISSES = PERF_EVENT_COUNT // Generic last level misses, not part of a PerfGroup
+};
+
+// Open one hardware counter for the calling thread, -1 if it isn't available
+// Counters in a group (groupFd of the leader) are read together
+static inline int openPerfEvent(PerfEvent event, int groupFd, bool inherit) {
+#ifdef __linux__
+	perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	switch (event) {
+		case PERF_CYCLES:
+			attr.config = PERF_COUNT_HW_CPU_CYCLES;
+			break;
+		case PERF_INSTRUCTIONS:
+			attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+			break;
+		case PERF_L1_MISSES:
+			attr.type = PERF_TYPE_HW_CACHE;
+			attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+			break;
+		case PERF_LLC_MISSES:
+			attr.type = PERF_TYPE_HW_CACHE;
+			attr.config = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+			break;
+		case PERF_BRANCH_MISSES:
+			attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+			break;
+		case PERF_CACHE_MISSES:
+			attr.config = PERF_COUNT_HW_CACHE_MISSES;
+			break;
+	}
+	attr.disabled = (groupFd < 0) ? 1 : 0; // Group members follow their leader
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.inherit = inherit ? 1 : 0;
+	if (groupFd < 0 && !inherit) attr.read_format = PERF_FORMAT_GROUP;
+	return syscall(__NR_perf_event_open, &attr, 0, -1, groupFd, 0);
+#else
+	return -1;
+#endif
+}
+
+// One hardware counter for the thread that opens it and any threads it starts afterwards
+// Only available on Linux with perf events allowed; valid() is false otherwise and counts read 0
+class PerfCounter {
+private:
+	int fd;
+
+	PerfCounter(const PerfCounter&) = delete;
+	PerfCounter& operator=(const PerfCounter&) = delete;
+
+public:
+	PerfCounter(PerfEvent event) {
+		fd = openPerfEvent(event, -1, true);
+	}
+	~PerfCounter() {
+#ifdef __linux__
+		if (fd >= 0) close(fd);
+#endif
+	}
+
+	bool valid() {
+		return fd >= 0;
+	}
+
+	void start() {
+#ifdef __linux__
+		if (fd < 0) return;
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+	}
+
+	// Count since start()
+	uint64_t stop() {
+		uint64_t count = 0;
+#ifdef __linux__
+		if (fd < 0) return 0;
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(fd, &count, sizeof(count)) != sizeof(count)) count = 0;
+#endif
+		return count;
+	}
+};
+
+// Every PerfEvent for the calling thread, read with one system call
+// Events the CPU doesn't have read 0
+class PerfGroup {
+private:
+	int fds[PERF_EVENT_COUNT];
+	int slot[PERF_EVENT_COUNT]; // Position in the group read, -1 if not open
+	int opened;
+
+	PerfGroup(const PerfGroup&) = delete;
+	PerfGroup& operator=(const PerfGroup&) = delete;
+
+public:
+	PerfGroup() {
+		opened = 0;
+		for (int e = 0; e < PERF_EVENT_COUNT; e++) {
+			fds[e] = -1;
+			slot[e] = -1;
+		}
+		for (int e = 0; e < PERF_EVENT_COUNT; e++) {
+			fds[e] = openPerfEvent((PerfEvent)e, (e == 0) ? -1 : fds[0], false);
+			if (fds[e] >= 0) slot[e] = opened++;
+			else if (e == 0) break; // No leader, no group
+		}
+#ifdef __linux__
+		if (fds[0] >= 0) ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+	}
+	~PerfGroup() {
+#ifdef __linux__
+		for (int e = 0; e < PERF_EVENT_COUNT; e++) {
+			if (fds[e] >= 0) close(fds[e]);
+		}
+#endif
+	}
+
+	bool valid() {
+		return opened > 0;
+	}
+
+	// Running totals of every event
+	void read(uint64_t values[PERF_EVENT_COUNT]) {
+		uint64_t buffer[PERF_EVENT_COUNT + 1];
+		bool ok = false;
+#ifdef __linux__
+		if (opened > 0) ok = (::read(fds[0], buffer, sizeof(uint64_t)*(opened + 1)) == (ssize_t)(sizeof(uint64_t)*(opened + 1)));
+#endif
+		for (int e = 0; e < PERF_EVENT_COUNT; e++) values[e] = (ok && slot[e] >= 0) ? buffer[1 + slot[e]] : 0;
+	}
+};
+
+// Hardware counts split by worker and by phase of the step
+// Each worker attaches from its own thread, then brackets its work with begin() and end()
+class PhaseCounters {
+private:
+	struct Worker {
+		PerfGroup *group;
+		uint64_t mark[PERF_EVENT_COUNT];
+		uint64_t totals[PERF_MAX_PHASES][PERF_EVENT_COUNT];
+		char pad[64]; // Keep neighbouring workers' totals off the same cache line
+	};
+
+	std::vector<Worker*> workers;
+	std::vector<std::string> phaseNames;
+
+public:
+	PhaseCounters(unsigned int numWorkers, const std::vector<std::string> &phaseNamesIn) {
+		phaseNames = phaseNamesIn;
+		for (unsigned int w = 0; w < numWorkers; w++) {
+			workers.push_back(new Worker);
+			workers[w]->group = NULL;
+		}
+		reset();
+	}
+	~PhaseCounters() {
+		for (unsigned int w = 0; w < workers.size(); w++) {
+			delete workers[w]->group;
+			delete workers[w];
+		}
+	}
+
+	// Call from the worker's own thread before it counts anything
+	bool attach(unsigned int worker) {
+		if (workers[worker]->group == NULL) workers[worker]->group = new PerfGroup;
+		return workers[worker]->group->valid();
+	}
+
+	bool valid() {
+		for (unsigned int w = 0; w < workers.size(); w++) {
+			if (workers[w]->group != NULL && workers[w]->group->valid()) return true;
+		}
+		return false;
+	}
+
+	void begin(unsigned int worker) {
+		Worker *current = workers[worker];
+		if (current->group != NULL) current->group->read(current->mark);
+	}
+
+	void end(unsigned int worker, unsigned int phase) {
+		Worker *current = workers[worker];
+		if (current->group == NULL) return;
+		uint64_t now[PERF_EVENT_COUNT];
+		current->group->read(now);
+		for (int e = 0; e < PERF_EVENT_COUNT; e++) current->totals[phase][e] += now[e] - current->mark[e];
+	}
+
+	// Only call while no worker is counting
+	void reset() {
+		for (unsigned int w = 0; w < workers.size(); w++) memset(workers[w]->totals, 0, sizeof(workers[w]->totals));
+	}
+
+	// One line per phase and worker, averaged over steps
+	std::string format(unsigned int steps) {
+		if (!valid()) return "perf counters unavailable\n";
+		if (steps == 0) steps = 1;
+		std::string text = "phase/worker kcyc IPC kL1 kLLC kbr (per step)\n";
+		char line[128];
+		for (unsigned int p = 0; p < phaseNames.size() && p < PERF_MAX_PHASES; p++) {
+			for (unsigned int w = 0; w < workers.size(); w++) {
+				uint64_t *total = workers[w]->totals[p];
+				if (total[PERF_CYCLES] == 0) continue;
+				snprintf(line, sizeof(line), "%s/%u %.1f %.2f %.1f %.1f %.1f\n", phaseNames[p].c_str(), w,
+								 total[PERF_CYCLES]/1000.0/steps, (double)total[PERF_INSTRUCTIONS]/total[PERF_CYCLES],
+								 total[PERF_L1_MISSES]/1000.0/steps, total[PERF_LLC_MISSES]/1000.0/steps,
+								 total[PERF_BRANCH_MISSES]/1000.0/steps);
+				text += line;
+			}
+		}
+		return text;
+	}
+};
+
+}
+
+#endif
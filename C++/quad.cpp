@@ -4,7 +4,7 @@
 
 namespace z {
 	
-	Quad::Quad(Quad *parentQ, unsigned int thisLevel, unsigned int maxLevel, unsigned int childNum, double xMin, double xMax, double yMin, double yMax) {
+	Quad::Quad(Quad *parentQ, unsigned int thisLevel, unsigned int maxLevel, unsigned int childNum, double xMin, double xMax, double yMin, double yMax, unsigned int listReserve) {
 		this->xMin = xMin;
 		this->xMax = xMax;
 		this->yMin = yMin;
@@ -16,31 +16,39 @@ namespace z {
 		if (thisLevel == 0) {
 			parentQuad = NULL;
 			this->childNum = 0;
+			nodeKey = 0;
 		}
 		else	{
 			parentQuad = parentQ;
 			this->childNum = childNum;
+			nodeKey = levelOffset(level) + (parentQ->nodeKey - levelOffset(level - 1))*4 + childNum;
 		}
 		
-		residentList.reserve(MAX_PARTICLES);
+		residentList.reserve(listReserve);
 		
 		tooManyNulls = false;
+		awake = 0;
 				
 		if (thisLevel < maxLevel) {
 			double xRange = (xMax - xMin)/2.0;
 			double yRange = (yMax - yMin)/2.0;
 			// Assuming positive y is down, positive x is right
 			// Top left
-			childQuad[0] = new Quad(this, level + 1, maxLevel, 0, xMin, xMin+xRange, yMin, yMin+yRange);
+			childQuad[0] = new Quad(this, level + 1, maxLevel, 0, xMin, xMin+xRange, yMin, yMin+yRange, listReserve);
 			// Top right
-			childQuad[1] = new Quad(this, level + 1, maxLevel, 1, xMin+xRange, xMax, yMin, yMin+yRange);
+			childQuad[1] = new Quad(this, level + 1, maxLevel, 1, xMin+xRange, xMax, yMin, yMin+yRange, listReserve);
 			// Bottom left
-			childQuad[2] = new Quad(this, level + 1, maxLevel, 2, xMin, xMin+xRange, yMin+yRange, yMax);
+			childQuad[2] = new Quad(this, level + 1, maxLevel, 2, xMin, xMin+xRange, yMin+yRange, yMax, listReserve);
 			// Bottom right
-			childQuad[3] = new Quad(this, level + 1, maxLevel, 3, xMin+xRange, xMax, yMin+yRange, yMax);
+			childQuad[3] = new Quad(this, level + 1, maxLevel, 3, xMin+xRange, xMax, yMin+yRange, yMax, listReserve);
 		}
 		else for (int i = 0; i <= 3; i++) childQuad[i] = NULL;
 	}
+	
+	// Frees the quads below, not the particles
+	Quad::~Quad() {
+		for (int i = 0; i <= 3; i++) delete childQuad[i];
+	}
 		
 	// Pass unique ID of particle that resides in this quad
 	// Particle will be moved to correct location in tree
@@ -48,29 +56,40 @@ namespace z {
 		bool found = false;
 		unsigned int pID = sortedParticle->id;
 		unsigned int i;
-		for (i = 0; i < residentList.size() && !found; i++) {
+		// Other threads may be adding to this list, so only look at it under the lock
+		// The lock isn't held while trickling, which takes the locks of other quads
+		writingLock.lock();
+		for (i = 0; i < residentList.size(); i++) {
 			if (residentList[i] != NULL && residentList[i]->id == pID) {
 				found = true;
-				if (trickleParticle(sortedParticle, true)) { // Return true if particle is moved
-					// This function may take some time to return
-					// Another thread may have reordered this residentList
-					// Make sure it's the right particle
-					if (residentList[i]->id == pID) 
+				break;
+			}
+		}
+		writingLock.unlock();
+		if (found && trickleParticle(sortedParticle, true)) { // Return true if particle is moved
+			// Entries don't move while sorting, but check it's still the right particle
+			writingLock.lock();
+			if (residentList[i] == sortedParticle) residentList[i] = NULL;
+			else {
+				for (i = 0; i < residentList.size(); i++) {
+					if (residentList[i] == sortedParticle) {
 						residentList[i] = NULL;
-					else {
-						found = false;
-						for (i = 0; i < residentList.size() && !found; i++) {
-							if (residentList[i] != NULL && residentList[i]->id == pID) 
-								residentList[i] = NULL;
-						}
+						break;
 					}
 				}
 			}
+			writingLock.unlock();
 		}
 		return found;
 	}
 	
 	void Quad::cleanResidentList() {
+		cleanResidents();
+		if (level < maxLevel) for (int i = 0; i <= 3; i++) childQuad[i]->cleanResidentList();
+	}
+	
+	// Compact this quad's list only
+	void Quad::cleanResidents() {
 		if (tooManyNulls) {
 			int frontSwap = 0;
 			int backSwap = residentList.size() - 1;
@@ -93,7 +112,6 @@ namespace z {
 				residentList.erase(residentList.begin()+backSwap, residentList.end());
 			}
 		}
-		if (level < maxLevel) for (int i = 0; i <= 3; i++) childQuad[i]->cleanResidentList();
 	}
 		
 	bool Quad::addParticle(Ball *movedParticle, bool checkBounds) {
@@ -114,18 +132,21 @@ namespace z {
 			else {
 				residentList.push_back(movedParticle);
 			}
+			movedParticle->quadResidence = this; // Before unlocking, another thread may sort it straight away
 			writingLock.unlock();
-			
-			movedParticle->quadResidence = this;
 		}
 		return true; // This can't not work, I guess
 	}
 	
 	// Search for particle collisions in all particles lower in the tree than passed particle
 	// Also does double-duty counting number of NULLs in residentList
-	void Quad::collideParticles(Ball *particleA, bool resident) {
+	// Returns the number of contacts; FLAGS are the KernelFlags passed on to collisonUpdate
+	template <unsigned int FLAGS>
+	unsigned int Quad::collideParticles(Ball *particleA, bool resident) {
+		if (!resident && particleA->asleep && awake == 0) return 0; // Sleepers never touch each other
 		bool found = !resident;
 		unsigned int nullCount = 0;
+		unsigned int contacts = 0;
 		if (resident) { // Find particle in resident list
 			unsigned int i;
 			for (i = 0; i < residentList.size() && !found; i++) {
@@ -134,8 +155,8 @@ namespace z {
 					i++;
 					// Collide all particles under it
 					for (; i < residentList.size(); i++) {
-						if (residentList[i] != NULL && residentList[i]->alive) 
-							particles->collisonUpdate(particleA, residentList[i]);
+						if (residentList[i] != NULL && residentList[i]->alive && particles->collisonUpdate<FLAGS>(particleA, residentList[i]))
+							contacts++;
 					}
 				}
 				else nullCount++;
@@ -143,17 +164,88 @@ namespace z {
 		}
 		else {
 			for (unsigned int i = 0; i < residentList.size(); i++) {
-				if (residentList[i] != NULL && residentList[i]->alive)
-					particles->collisonUpdate(particleA, residentList[i]);
+				if (residentList[i] != NULL && residentList[i]->alive && particles->collisonUpdate<FLAGS>(particleA, residentList[i]))
+					contacts++;
 			}
 		}
 		// Do not collide children if particle was supposed to be found and wasn't
 		if (found && level < maxLevel) {
 			for (unsigned int i = 0; i <= 3; i++) {
-				childQuad[i]->collideParticles(particleA, false);
+				contacts += childQuad[i]->collideParticles<FLAGS>(particleA, false);
 			}
 		}
 		if (nullCount > MAX_NULLS) tooManyNulls = true;
+		return contacts;
+	}
+	
+	// Collide each resident with the residents after it and everything below this quad
+	// Same pairs as calling collideParticles for each resident, without searching for it first
+	template <unsigned int FLAGS>
+	unsigned int Quad::collideResidents(bool recurse) {
+		if (awake == 0) return 0;
+		unsigned int nullCount = 0;
+		unsigned int contacts = 0;
+		for (unsigned int i = 0; i < residentList.size(); i++) {
+			Ball *particleA = residentList[i];
+			if (particleA == NULL) {
+				nullCount++;
+				continue;
+			}
+			if (!particleA->alive) continue;
+			for (unsigned int j = i + 1; j < residentList.size(); j++) {
+				if (residentList[j] != NULL && residentList[j]->alive && particles->collisonUpdate<FLAGS>(particleA, residentList[j]))
+					contacts++;
+			}
+			if (level < maxLevel) {
+				for (unsigned int c = 0; c <= 3; c++) contacts += childQuad[c]->collideParticles<FLAGS>(particleA, false);
+			}
+		}
+		if (nullCount > MAX_NULLS) tooManyNulls = true;
+		if (recurse && level < maxLevel) {
+			for (unsigned int c = 0; c <= 3; c++) contacts += childQuad[c]->collideResidents<FLAGS>(true);
+		}
+		return contacts;
+	}
+	
+	// Contacts between one moving particle and the residents of this static tree
+	// Only the moving particle is pushed, so every tile can search the tree at once
+	template <unsigned int FLAGS>
+	unsigned int Quad::collideStatic(Ball *particleA) {
+		if (!reaches(particleA->x - particleA->reach, particleA->x + particleA->reach,
+						particleA->y - particleA->reach, particleA->y + particleA->reach)) return 0;
+		unsigned int contacts = 0;
+		for (unsigned int i = 0; i < residentList.size(); i++) {
+			if (residentList[i] != NULL && residentList[i]->alive && particles->staticUpdate<FLAGS>(particleA, residentList[i]))
+				contacts++;
+		}
+		if (level < maxLevel) {
+			for (unsigned int c = 0; c <= 3; c++) contacts += childQuad[c]->collideStatic<FLAGS>(particleA);
+		}
+		return contacts;
+	}
+	
+	// Only stickyness changes how pairs collide
+	template unsigned int Quad::collideParticles<0>(Ball*, bool);
+	template unsigned int Quad::collideParticles<KERNEL_STICKY>(Ball*, bool);
+	template unsigned int Quad::collideParticles<KERNEL_DYNAMIC>(Ball*, bool);
+	template unsigned int Quad::collideResidents<0>(bool);
+	template unsigned int Quad::collideResidents<KERNEL_STICKY>(bool);
+	template unsigned int Quad::collideResidents<KERNEL_DYNAMIC>(bool);
+	template unsigned int Quad::collideStatic<0>(Ball*);
+	template unsigned int Quad::collideStatic<KERNEL_STICKY>(Ball*);
+	template unsigned int Quad::collideStatic<KERNEL_DYNAMIC>(Ball*);
+	
+	// Call before collideResidents, once nothing else can move particles into or out of these quads
+	unsigned int Quad::countAwake() {
+		unsigned int count = 0;
+		for (unsigned int i = 0; i < residentList.size(); i++) {
+			if (residentList[i] != NULL && residentList[i]->alive && !residentList[i]->asleep) count++;
+		}
+		if (level < maxLevel) {
+			for (unsigned int c = 0; c <= 3; c++) count += childQuad[c]->countAwake();
+		}
+		awake = count;
+		return count;
 	}
 	
 	bool Quad::checkIfResident(unsigned long int pID, bool deleteResident) {
@@ -168,6 +260,57 @@ namespace z {
 		return found;
 	}
 
+	// True if particles living in this quad could touch the passed box
+	// The root keeps particles outside the window so always could
+	bool Quad::reaches(double qxMin, double qxMax, double qyMin, double qyMax) {
+		return level == 0 || !(qxMax < xMin - QUERY_MARGIN || qxMin > xMax + QUERY_MARGIN ||
+										qyMax < yMin - QUERY_MARGIN || qyMin > yMax + QUERY_MARGIN);
+	}
+	
+	// True if a live particle in this quad or below overlaps the passed circle
+	bool Quad::checkOverlap(double x, double y, double radius) {
+		if (!reaches(x - radius, x + radius, y - radius, y + radius)) return false;
+		for (unsigned int i = 0; i < residentList.size(); i++) {
+			Ball *resident = residentList[i];
+			if (resident != NULL && resident->alive) {
+				if (sqrt(pow(x - resident->x, 2.0) + pow(y - resident->y, 2.0)) + 0.001 < radius + resident->radius) {
+					return true;
+				}
+			}
+		}
+		if (level < maxLevel) {
+			for (unsigned int i = 0; i <= 3; i++) {
+				if (childQuad[i]->checkOverlap(x, y, radius)) return true;
+			}
+		}
+		return false;
+	}
+
+	// Collect live particles in this quad and below with centres inside the circle
+	void Quad::queryCircle(double x, double y, double rad, std::vector<Ball*> &found) {
+		if (!reaches(x - rad, x + rad, y - rad, y + rad)) return;
+		for (unsigned int i = 0; i < residentList.size(); i++) {
+			Ball *resident = residentList[i];
+			if (resident != NULL && resident->alive) {
+				if (sqrt(pow(resident->x - x, 2.0) + pow(resident->y - y, 2.0)) <= rad) found.push_back(resident);
+			}
+		}
+		if (level < maxLevel) for (unsigned int i = 0; i <= 3; i++) childQuad[i]->queryCircle(x, y, rad, found);
+	}
+	
+	// Collect live particles in this quad and below with centres inside the box
+	void Quad::queryRect(double qxMin, double qxMax, double qyMin, double qyMax, std::vector<Ball*> &found) {
+		if (!reaches(qxMin, qxMax, qyMin, qyMax)) return;
+		for (unsigned int i = 0; i < residentList.size(); i++) {
+			Ball *resident = residentList[i];
+			if (resident != NULL && resident->alive) {
+				if (resident->x >= qxMin && resident->x <= qxMax && resident->y >= qyMin && resident->y <= qyMax)
+					found.push_back(resident);
+			}
+		}
+		if (level < maxLevel) for (unsigned int i = 0; i <= 3; i++) childQuad[i]->queryRect(qxMin, qxMax, qyMin, qyMax, found);
+	}
+	
 	// Checks bounds and passes to correct Quad if necessary
 	// Return true if particle is moved
 	bool Quad::trickleParticle(Ball *movingParticle, bool checkBounds) {
@@ -211,8 +354,8 @@ namespace z {
 			}
 		}
 		if (level < maxLevel) {  // Particle is within bounds - See if it needs moving to child
-			double xMid = xMin + (xMax - xMin)/2.0;
-			double yMid = yMin + (yMax - yMin)/2.0;
+			scalar xMid = xMin + (xMax - xMin)/2;
+			scalar yMid = yMin + (yMax - yMin)/2;
 			if (movingParticle->yMax < yMid) { // Top
 				if (movingParticle->xMax < xMid) { // Left
 					return moveToChild(0, movingParticle);
@@ -231,6 +374,7 @@ namespace z {
 			}
 		}
 		// Particle cannot be moved anywhere else		
+		setSortSlack(movingParticle);
 		
 		/*
 		std::cout << "\n";
@@ -259,6 +403,35 @@ namespace z {
 		return childQuad[childNum]->addParticle(movedParticle, false);
 	}
 	
+	// Distance the particle can travel on either axis before trickleParticle could move it:
+	// it must stay inside this quad and keep straddling a midline
+	void Quad::setSortSlack(Ball *residentParticle) {
+		scalar slack = HUGE_VAL;
+		if (level > 0) {
+			slack = std::min(std::min(residentParticle->xMin - xMin, xMax - residentParticle->xMax),
+									std::min(residentParticle->yMin - yMin, yMax - residentParticle->yMax));
+		}
+		if (level < maxLevel) {
+			scalar xMid = xMin + (xMax - xMin)/2;
+			scalar yMid = yMin + (yMax - yMin)/2;
+			scalar xStraddle = std::max(scalar(0), std::min(residentParticle->xMax - xMid, xMid - residentParticle->xMin));
+			scalar yStraddle = std::max(scalar(0), std::min(residentParticle->yMax - yMid, yMid - residentParticle->yMin));
+			slack = std::min(slack, std::max(xStraddle, yStraddle));
+		}
+		residentParticle->setSortSlack(slack);
+	}
+	
+	// Store this quad and all below it by node key
+	void Quad::indexNodes(std::vector<Quad*> &nodes) {
+		nodes[nodeKey] = this;
+		if (level < maxLevel) for (int i = 0; i <= 3; i++) childQuad[i]->indexNodes(nodes);
+	}
+	
+	// Number of quads in all levels above the passed one
+	unsigned int Quad::levelOffset(unsigned int level) {
+		return ((1u << (2*level)) - 1)/3;
+	}
+	
 	void Quad::printParams() {
 		std::cout << "Level: " << level << ", Child: " << childNum;
 		std::cout << ", xMin, xMax, yMin, yMax: " << xMin << "\t" << xMax << "\t" << yMin << "\t" << yMax << "\n";
@@ -6,8 +6,10 @@
 #include <iostream>
 
 #include "spinlock.hpp"
+#include "scalar.hpp"
 
 #define MAX_NULLS 10
+#define QUERY_MARGIN 5.0 // Max travel since last sort (tickTimeMax holds steps to half the smallest diameter)
 
 namespace z {
 
@@ -25,25 +27,39 @@ public:
 	unsigned int level;
 	unsigned int maxLevel;
 	unsigned int childNum;
-	double xMin;
-	double xMax;
-	double yMin;
-	double yMax;
+	unsigned int nodeKey; // Level offset plus Morton index within level
+	scalar xMin;
+	scalar xMax;
+	scalar yMin;
+	scalar yMax;
 	bool tooManyNulls;
+	unsigned int awake; // Awake particles here and below, counted before colliding
 	SpinLock writingLock;
 		
 	static Particles *particles;
 	
-	Quad(Quad*, unsigned int, unsigned int, unsigned int, double, double, double, double);
+	Quad(Quad*, unsigned int, unsigned int, unsigned int, double, double, double, double, unsigned int);
+	~Quad();
 	bool sortParticle(Ball*);
 	void cleanResidentList();
-	void collideParticles(Ball*, bool);
+	void cleanResidents();
+	template <unsigned int FLAGS> unsigned int collideParticles(Ball*, bool);
+	template <unsigned int FLAGS> unsigned int collideResidents(bool);
+	unsigned int countAwake();
+	template <unsigned int FLAGS> unsigned int collideStatic(Ball*);
 	bool addParticle(Ball*, bool);
 	bool checkIfResident(unsigned long int, bool);
+	bool checkOverlap(double, double, double);
+	void queryCircle(double, double, double, std::vector<Ball*>&);
+	void queryRect(double, double, double, double, std::vector<Ball*>&);
+	bool reaches(double, double, double, double);
 	bool trickleParticle(Ball*, bool);
 	bool moveToGrandparent(Ball*);
 	bool movetoParent(Ball*);
 	bool moveToChild(unsigned int, Ball*);
+	void setSortSlack(Ball*);
+	void indexNodes(std::vector<Quad*>&);
+	static unsigned int levelOffset(unsigned int);
 	void printParams();
 };
 }
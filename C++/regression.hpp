@@ -0,0 +1,345 @@
+#ifndef REGRESSION_HPP
+#define REGRESSION_HPP
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cmath>
+#include <thread>
+
+#include "particles.hpp"
+#include "taskGraph.hpp"
+
+#define REGRESS_FILE "regression.txt"
+#define REGRESS_RES_X 1500
+#define REGRESS_RES_Y 900
+#define REGRESS_SEED 1
+#define REGRESS_STEPS 1000
+#define REGRESS_TICKTIME 0.001
+#define REGRESS_REFINE 4 // Reference runs take this many steps for each regular one
+#define REGRESS_POS_TOL 5.0 // Pixels the centroid may move from the golden run
+#define REGRESS_ENERGY_TOL 0.1 // Fraction the kinetic energy may change from the golden run
+#define REGRESS_WORKERS 3 // Workers sharing the step in the parallel modes
+#define REGRESS_WAKE_SCENE "wake" // Has to fall asleep in the sleeping modes
+#define REGRESS_SUM_TOL 1e-9 // Fraction energy and momentum may differ between worker counts, from summing in another order
+
+namespace z {
+
+// Runs canonical scenes headless and checks them against stored results
+// Every step option is timed and compared with a finer-stepped reference,
+// so a faster step can't quietly change the physics
+class Regression {
+private:
+	// Reduced final state of one run
+	struct Outcome {
+		int alive;
+		int sleeping; // Most particles asleep at once
+		double xCenter, yCenter;
+		double kineticEnergy;
+		double xMomentum, yMomentum;
+		double stepsPerSecond;
+	};
+
+	// A way of stepping Particles, everything else held the same
+	struct Mode {
+		const char *name;
+		bool rebuild;
+		bool sleeping;
+		bool bhField;
+		unsigned int workers;
+	};
+
+	std::vector<std::string> scenes;
+	std::vector<Mode> modes;
+	int resX, resY;
+	double tickTime;
+	bool perf; // Count hardware events for each run
+	std::string perfText;
+
+	void buildScene(Particles &particles, const std::string &scene) {
+		particles.rng.seed(REGRESS_SEED);
+		particles.particleCollisions = true;
+		particles.particleStickyness = false;
+		particles.boundCeiling = particles.boundWalls = particles.boundFloor = true;
+		particles.linGravity = 0;
+
+		if (scene == "pile") {
+			// Settling under gravity, lots of resting contacts
+			particles.linGravity = 1000.0;
+			particles.createInitBalls(2000, 0, 1);
+		}
+		else if (scene == "orbit") {
+			// Swirl around an attracting blackhole
+			particles.createInitBalls(1500, 0, 1);
+			for (unsigned int i = 0; i < particles.pSize; i++) {
+				Ball *ball = particles.ballV[i];
+				ball->xVel = -(ball->y - resY/2.0);
+				ball->yVel = ball->x - resX/2.0;
+			}
+			particles.createBH(resX/2, resY/2, 100000, 40, COLLISION);
+		}
+		else if (scene == "sticky") {
+			// Clumping with stickyness on, no gravity
+			particles.particleStickyness = true;
+			particles.createInitBalls(1200, 0, 1);
+			for (unsigned int i = 0; i < particles.pSize; i++) {
+				particles.ballV[i]->xVel = particles.randDouble(-100, 100);
+				particles.ballV[i]->yVel = particles.randDouble(-100, 100);
+			}
+		}
+		else if (scene == "impact") {
+			// Heavy cloud shot into a resting bed of lighter particles
+			particles.linGravity = 1000.0;
+			particles.createInitBalls(800, 1, 0);
+			particles.createCloud(250, 250, 120, 800, 0.3, 2, 2, false, true);
+		}
+		else if (scene == "funnel") {
+			// Particles poured through a funnel painted in place
+			particles.linGravity = 1000.0;
+			for (int k = 0; k < 12; k++) {
+				particles.createCloud(200 + k*40, 300 + k*30, 30, 0, 0, 0, 1, true, false);
+				particles.createCloud(1300 - k*40, 300 + k*30, 30, 0, 0, 0, 1, true, false);
+			}
+			for (int k = 0; k < 6; k++) particles.createCloud(450 + k*120, 150, 50, 0, 0, 0, 1, false, false);
+		}
+		else if (scene == "ramp") {
+			// Particles sliding down walls onto a solid block
+			particles.linGravity = 1000.0;
+			particles.obstacles.addSegment(100, 250, 900, 550, 20);
+			particles.obstacles.addSegment(1400, 450, 800, 750, 20);
+			// The block comes through the queue, the way Draw Walls sends an outline
+			double blockX[] = {600, 900, 950, 550}, blockY[] = {800, 800, 900, 900};
+			for (int k = 0; k < 4; k++) {
+				Command corner(CMD_ADD_OUTLINE_POINT);
+				corner.x = blockX[k];
+				corner.y = blockY[k];
+				particles.commands.push(corner);
+			}
+			particles.commands.push(Command(CMD_CLOSE_OUTLINE));
+			particles.applyCommands();
+			for (int k = 0; k < 5; k++) particles.createCloud(200 + k*250, 120, 60, 0, 0, 0, 1, false, false);
+		}
+		else if (scene == "wake") {
+			// Beds left at rest, which the sleeping modes put to sleep until editScene shoots into them
+			for (int k = 0; k < 3; k++) particles.createCloud(550 + k*300, 450, 120, 0, 0, 0, 1, false, false);
+		}
+	}
+
+	// Edits made partway through a scene, sent the way the draw thread sends them
+	void editScene(Particles &particles, const std::string &scene, unsigned int step, unsigned int steps) {
+		if (scene == "wake" && step == steps/2) {
+			Command cmd(CMD_CREATE_CLOUD);
+			cmd.x = 150;
+			cmd.y = 450;
+			cmd.rad = 80;
+			cmd.vel = 800;
+			cmd.diaClass = 1;
+			cmd.densityClass = 2;
+			cmd.force = true;
+			particles.commands.push(cmd);
+		}
+	}
+
+	Outcome run(const std::string &scene, const Mode &mode, unsigned int steps, double dt) {
+		Particles particles(&resX, &resY, &tickTime, 0);
+		particles.quadRebuild = mode.rebuild;
+		particles.setWorkers(mode.workers);
+		buildScene(particles, scene);
+		particles.particleSleeping = mode.sleeping;
+		particles.bhFieldCache = mode.bhField;
+		particles.prepareStep();
+
+		TaskGraph graph;
+		particles.buildStepGraph(graph, mode.rebuild);
+		TaskExecutor executor(mode.workers);
+		PhaseCounters counters(1, stepPhaseNames());
+		bool counting = perf && dt == REGRESS_TICKTIME && mode.workers == 1; // Reference and parallel runs aren't counted
+		if (counting) {
+			counters.attach(0);
+			executor.setCounters(&counters);
+		}
+		tickTime = dt;
+		int sleeping = 0;
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (unsigned int s = 0; s < steps; s++) {
+			executor.prepare(&graph);
+			// Helpers only live for the step, spinning between steps would starve a small machine
+			std::vector<std::thread> helpers;
+			for (unsigned int w = 1; w < mode.workers; w++) helpers.push_back(std::thread(&TaskExecutor::run, &executor, w));
+			executor.run(0);
+			for (unsigned int h = 0; h < helpers.size(); h++) helpers[h].join();
+			if (counting) counters.begin(0);
+			particles.moveBH();
+			particles.collectStats();
+			sleeping = std::max(sleeping, particles.ballSleeping);
+			editScene(particles, scene, s, steps);
+			particles.applyCommands();
+			if (particles.maintenanceDue()) particles.maintainParticles();
+			particles.publishFrame();
+			if (counting) counters.end(0, PHASE_BOUNDARY);
+		}
+		if (counting) perfText += scene + " " + mode.name + ", " + counters.format(steps);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		Outcome outcome;
+		outcome.alive = particles.ballAlive;
+		outcome.sleeping = sleeping;
+		outcome.kineticEnergy = particles.kineticEnergy;
+		outcome.xMomentum = particles.xMomentum;
+		outcome.yMomentum = particles.yMomentum;
+		outcome.stepsPerSecond = steps/std::max(seconds, 1e-9);
+		outcome.xCenter = outcome.yCenter = 0;
+		for (unsigned int i = 0; i < particles.pSize; i++) {
+			if (particles.ballV[i]->alive) {
+				outcome.xCenter += particles.ballV[i]->x;
+				outcome.yCenter += particles.ballV[i]->y;
+			}
+		}
+		if (outcome.alive > 0) {
+			outcome.xCenter /= outcome.alive;
+			outcome.yCenter /= outcome.alive;
+		}
+		return outcome;
+	}
+
+	// Single particles diverge quickly in these scenes, so runs are compared by their totals
+	static double centerDistance(const Outcome &a, const Outcome &b) {
+		return sqrt(pow(a.xCenter - b.xCenter, 2.0) + pow(a.yCenter - b.yCenter, 2.0));
+	}
+	static double energyChange(const Outcome &a, const Outcome &b) {
+		return (a.kineticEnergy - b.kineticEnergy)/std::max(b.kineticEnergy, 1.0);
+	}
+	static double momentumChange(const Outcome &a, const Outcome &b) {
+		double dx = a.xMomentum - b.xMomentum, dy = a.yMomentum - b.yMomentum;
+		return sqrt(dx*dx + dy*dy)/std::max(sqrt(b.xMomentum*b.xMomentum + b.yMomentum*b.yMomentum), 1.0);
+	}
+
+public:
+	Regression(bool perfIn) {
+		perf = perfIn;
+		resX = REGRESS_RES_X;
+		resY = REGRESS_RES_Y;
+		tickTime = REGRESS_TICKTIME;
+
+		scenes.push_back("pile");
+		scenes.push_back("orbit");
+		scenes.push_back("sticky");
+		scenes.push_back("impact");
+		scenes.push_back("funnel");
+		scenes.push_back("ramp");
+		scenes.push_back("wake");
+
+		// The first mode is the one golden results are taken from
+		// A tree rebuild doesn't depend on which worker does what, so rebuild3 has to match it exactly,
+		// while trickle3 is held to the particle count and energy
+		Mode rebuild = {"rebuild", true, false, false, 1};
+		Mode trickle = {"trickle", false, false, false, 1};
+		Mode sleep = {"sleep", false, true, false, 1};
+		Mode field = {"field", false, false, true, 1};
+		Mode rebuildParallel = {"rebuild3", true, false, false, REGRESS_WORKERS};
+		Mode trickleParallel = {"trickle3", false, false, false, REGRESS_WORKERS};
+		modes.push_back(rebuild);
+		modes.push_back(trickle);
+		modes.push_back(sleep);
+		modes.push_back(field);
+		modes.push_back(rebuildParallel);
+		modes.push_back(trickleParallel);
+	}
+
+	// Compare every scene and mode against the golden file, or rewrite it
+	// Returns the number of failures
+	int check(bool update) {
+		std::ifstream goldenIn(REGRESS_FILE);
+		std::vector<std::string> goldenScene;
+		std::vector<Outcome> golden;
+		std::string line;
+		while (std::getline(goldenIn, line)) {
+			if (line.empty() || line[0] == '#') continue;
+			std::istringstream fields(line);
+			std::string name;
+			Outcome outcome;
+			if (fields >> name >> outcome.alive >> outcome.xCenter >> outcome.yCenter >> outcome.kineticEnergy) {
+				goldenScene.push_back(name);
+				golden.push_back(outcome);
+			}
+		}
+		goldenIn.close();
+		if (!update && golden.empty()) {
+			std::cout << "No golden results in " << REGRESS_FILE << ", run with --regress-update first\n";
+			return 1;
+		}
+
+		std::ofstream goldenOut;
+		if (update) {
+			goldenOut.open(REGRESS_FILE);
+			goldenOut << "# scene alive xCenter yCenter kineticEnergy after " << REGRESS_STEPS << " steps of " << REGRESS_TICKTIME << " s\n";
+			goldenOut.precision(10);
+		}
+
+		int failures = 0;
+		double particleSteps = 0, seconds = 0;
+		std::cout << std::fixed;
+		std::cout.precision(2);
+		std::cout << "\t\t\t\t\tvs golden\t\tvs reference\n";
+		std::cout << "scene\tmode\tsteps/s\talive\tslept\tcenter\tenergy\tcenter\tenergy\n";
+		for (unsigned int c = 0; c < scenes.size(); c++) {
+			Outcome reference = run(scenes[c], modes[0], REGRESS_STEPS*REGRESS_REFINE, REGRESS_TICKTIME/REGRESS_REFINE);
+
+			const Outcome *stored = NULL;
+			for (unsigned int g = 0; g < goldenScene.size() && !update; g++) {
+				if (goldenScene[g] == scenes[c]) stored = &golden[g];
+			}
+
+			Outcome single;
+			for (unsigned int m = 0; m < modes.size(); m++) {
+				Outcome outcome = run(scenes[c], modes[m], REGRESS_STEPS, REGRESS_TICKTIME);
+				if (m == 0) single = outcome;
+				if (modes[m].workers == 1) { // Parallel runs also time starting their helper threads
+					particleSteps += (double)outcome.alive*REGRESS_STEPS;
+					seconds += REGRESS_STEPS/outcome.stepsPerSecond;
+				}
+				if (update && m == 0) {
+					goldenOut << scenes[c] << " " << outcome.alive << " " << outcome.xCenter << " "
+										<< outcome.yCenter << " " << outcome.kineticEnergy << "\n";
+				}
+
+				bool pass = true;
+				double shift = 0, energy = 0;
+				if (stored != NULL) {
+					shift = centerDistance(outcome, *stored);
+					energy = energyChange(outcome, *stored);
+					pass = (outcome.alive == stored->alive && fabs(energy) <= REGRESS_ENERGY_TOL);
+					// Which worker sorts first changes the trickle3 centroid from run to run, so it's only shown
+					if (modes[m].rebuild || modes[m].workers == 1) pass = pass && shift <= REGRESS_POS_TOL;
+				}
+				else if (!update) pass = false;
+				if (modes[m].rebuild && modes[m].workers > 1 &&
+						(outcome.alive != single.alive || outcome.xCenter != single.xCenter || outcome.yCenter != single.yCenter ||
+						 fabs(energyChange(outcome, single)) > REGRESS_SUM_TOL || momentumChange(outcome, single) > REGRESS_SUM_TOL)) {
+					pass = false;
+				}
+				// A sleeping mode that never sleeps would pass everything else
+				if (modes[m].sleeping && scenes[c] == REGRESS_WAKE_SCENE && outcome.sleeping == 0) pass = false;
+				if (!pass) failures++;
+
+				std::cout << scenes[c] << "\t" << modes[m].name << "\t" << (int)outcome.stepsPerSecond << "\t"
+									<< outcome.alive << "\t" << outcome.sleeping << "\t" << shift << "\t" << energy*100.0 << "%\t"
+									<< centerDistance(outcome, reference) << "\t" << energyChange(outcome, reference)*100.0 << "%"
+									<< (pass ? "" : "\tFAIL") << "\n";
+			}
+		}
+		std::cout << "reference runs take " << REGRESS_REFINE << "x smaller steps\n";
+		std::cout << SCALAR_NAME << " build, " << (long)(particleSteps/std::max(seconds, 1e-9)) << " particle steps/s over every scene and mode\n";
+		if (perf) std::cout << "\n" << perfText;
+		std::cout << ((failures == 0) ? "PASS" : "FAIL") << " (" << failures << " failed)\n";
+		return failures;
+	}
+};
+
+}
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef RENDER_FRAME_HPP
+#define RENDER_FRAME_HPP
+
+#include <SFML/Graphics.hpp>
+#include <vector>
+#include <atomic>
+#include <cmath>
+
+#define DISC_TEXTURE_SIZE 64
+#define FRAME_FRESH 4 // Flag on the ready index, set until the draw thread takes the frame
+
+namespace z {
+
+// Vertices of one tile's particles, one textured quad per disc
+struct RenderTile {
+	std::vector<sf::Vertex> vertices;
+	double xMin, xMax, yMin, yMax; // Bounds of the discs
+
+	void clear() {
+		vertices.clear();
+		xMin = yMin = HUGE_VAL;
+		xMax = yMax = -HUGE_VAL;
+	}
+
+	void addDisc(double x, double y, double radius, sf::Color color) {
+		float left = x - radius, right = x + radius;
+		float top = y - radius, bottom = y + radius;
+		vertices.push_back(sf::Vertex(sf::Vector2f(left, top), color, sf::Vector2f(0, 0)));
+		vertices.push_back(sf::Vertex(sf::Vector2f(right, top), color, sf::Vector2f(DISC_TEXTURE_SIZE, 0)));
+		vertices.push_back(sf::Vertex(sf::Vector2f(right, bottom), color, sf::Vector2f(DISC_TEXTURE_SIZE, DISC_TEXTURE_SIZE)));
+		vertices.push_back(sf::Vertex(sf::Vector2f(left, bottom), color, sf::Vector2f(0, DISC_TEXTURE_SIZE)));
+		if (left < xMin) xMin = left;
+		if (right > xMax) xMax = right;
+		if (top < yMin) yMin = top;
+		if (bottom > yMax) yMax = bottom;
+	}
+};
+
+// Counts and totals as of the step a frame shows, for the HUD
+struct FrameStats {
+	unsigned int particles, alive, sleeping;
+	unsigned int blackholes, bhAlive;
+	double maxVel;
+	unsigned int contacts;
+	double kineticEnergy, momentum;
+
+	FrameStats() {
+		particles = alive = sleeping = 0;
+		blackholes = bhAlive = 0;
+		maxVel = 0;
+		contacts = 0;
+		kineticEnergy = momentum = 0;
+	}
+};
+
+// Everything the draw thread needs for one step
+struct RenderFrame {
+	FrameStats stats;
+	std::vector<RenderTile> tiles;
+	std::vector<sf::CircleShape> bhShapes;
+	std::vector<sf::Vertex> obstacles; // Untextured triangles
+};
+
+// Triple buffer between the physics workers and the draw thread
+// Physics fills the back frame and publishes it, draw takes the newest published frame
+// Neither side ever waits on the other
+class RenderPipeline {
+private:
+	RenderFrame frames[3];
+	std::atomic<int> ready; // Index of the last published frame, plus FRAME_FRESH if not yet taken
+	int writing; // Only touched by the producer
+	int reading; // Only touched by the consumer
+
+public:
+	RenderPipeline() {
+		writing = 0;
+		ready = 1;
+		reading = 2;
+	}
+
+	void setTiles(unsigned int numTiles) {
+		for (int k = 0; k < 3; k++) {
+			frames[k].tiles.resize(numTiles);
+			for (unsigned int t = 0; t < numTiles; t++) frames[k].tiles[t].clear();
+		}
+	}
+
+	// True once the draw thread has taken the last published frame
+	bool wanted() {
+		return !(ready.load() & FRAME_FRESH);
+	}
+
+	RenderFrame& back() {
+		return frames[writing];
+	}
+
+	void publish() {
+		writing = ready.exchange(writing | FRAME_FRESH) & ~FRAME_FRESH;
+	}
+
+	// Swap in the newest frame if there is one, the last one stays current otherwise
+	bool acquire() {
+		if (!(ready.load() & FRAME_FRESH)) return false;
+		reading = ready.exchange(reading) & ~FRAME_FRESH;
+		return true;
+	}
+
+	RenderFrame& front() {
+		return frames[reading];
+	}
+};
+
+}
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef RNG_HPP
+#define RNG_HPP
+
+#include <cstdint>
+
+namespace z {
+
+// Small xorshift128+ generator, so runs can be repeated from a seed
+// Not thread safe; each user owns one
+class Rng {
+private:
+	uint64_t state[2];
+
+	// Spread a seed over the whole state, so nearby seeds give unrelated streams
+	static uint64_t splitMix(uint64_t &x) {
+		uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+		z = (z ^ (z >> 30))*0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27))*0x94D049BB133111EBULL;
+		return z ^ (z >> 31);
+	}
+
+public:
+	Rng(uint64_t seedIn = 1) {
+		seed(seedIn);
+	}
+
+	void seed(uint64_t seedIn) {
+		state[0] = splitMix(seedIn);
+		state[1] = splitMix(seedIn);
+	}
+
+	uint64_t next() {
+		uint64_t s1 = state[0];
+		const uint64_t s0 = state[1];
+		state[0] = s0;
+		s1 ^= s1 << 23;
+		state[1] = s1 ^ s0 ^ (s1 >> 17) ^ (s0 >> 26);
+		return state[1] + s0;
+	}
+
+	// 0 to range - 1
+	unsigned int nextInt(unsigned int range) {
+		return (unsigned int)(next() >> 32)%range;
+	}
+
+	// minimum to maximum
+	double nextDouble(double minimum, double maximum) {
+		double r = (next() >> 11)*(1.0/9007199254740992.0);
+		return minimum + r*(maximum - minimum);
+	}
+};
+
+}
+
+#endif
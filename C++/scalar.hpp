@@ -0,0 +1,18 @@
+#ifndef SCALAR_HPP
+#define SCALAR_HPP
+
+namespace z {
+
+// Type of the particle state and the step maths
+// Build with -DSINGLE_PRECISION for float; totals summed over many particles stay double
+#ifdef SINGLE_PRECISION
+typedef float scalar;
+#define SCALAR_NAME "float"
+#else
+typedef double scalar;
+#define SCALAR_NAME "double"
+#endif
+
+}
+
+#endif
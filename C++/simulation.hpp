@@ -12,15 +12,19 @@
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <chrono>
 
 #include "quad.hpp"
 #include "barrier.hpp"
+#include "taskGraph.hpp"
 #include "particles.hpp"
 #include "input.hpp"
 
 //==============================
 
 #define MAX_TICKTIME 0.001666
+#define FIXED_TICKTIME 0.001 // Step used when running a fixed number of steps
+#define PERF_REPORT_STEPS 200 // Steps averaged into each hardware counter report
 #define TICKTIME_AVGFILT 0.05
 #define SCALEFACT_AVGFILT 5.0
 
@@ -43,10 +47,8 @@
 
 //==============================
 
-static std::mutex pauseMutex1;
-static std::mutex pauseMutex2;
-static std::condition_variable pauseCV1;
-static std::condition_variable pauseCV2;
+static std::mutex pauseMutex;
+static std::condition_variable pauseCV;
 
 namespace z {
 
@@ -64,9 +66,13 @@ private:
 	sfg::CheckButton::Ptr cbBoundCeiling;
 	sfg::CheckButton::Ptr cbBoundWalls;
 	sfg::CheckButton::Ptr cbBoundFloor;
+	sfg::CheckButton::Ptr cbQuadRebuild;
+	sfg::CheckButton::Ptr cbSleeping;
+	sfg::CheckButton::Ptr cbBHField;
 	sfg::ToggleButton::Ptr bPause;
 	sfg::Button::Ptr bDebug;
 	sfg::Button::Ptr bClear;
+	sfg::Button::Ptr bClearWalls;
 	sfg::Button::Ptr bStop;
 	sfg::ProgressBar::Ptr scaleBar;
 	sfg::Scale::Ptr scaleScale;
@@ -80,12 +86,14 @@ private:
 	sfg::RadioButton::Ptr mouseFuncShoot; // Shoot
 	sfg::RadioButton::Ptr mouseFuncPlaceBH; // Place Blackhole
 	sfg::RadioButton::Ptr mouseFuncControlBH; // Control Blackhole
+	sfg::RadioButton::Ptr mouseFuncWall; // Draw Walls
 	sfg::RadioButton::Ptr shootFuncClick;
 	sfg::RadioButton::Ptr shootFuncDrag;
 	sfg::CheckButton::Ptr bhPermCheckButton;
 	sfg::CheckButton::Ptr eraseFuncCheckButton;
 	sfg::CheckButton::Ptr paintOvrCheckButton;
 	sfg::CheckButton::Ptr paintForceCheckButton;
+	sfg::CheckButton::Ptr paintFixedCheckButton;
 	
 	sf::Clock clockP;
 	sf::Time elapsedTimeP;
@@ -97,65 +105,82 @@ private:
 	
 	bool running;
 	bool debugRead;
+	bool stepRunning, stepPaused; // Latched at the step boundary so every worker agrees
+	unsigned int stealsPerStep;
+	
+	// Deterministic mode
+	unsigned long seed;
+	unsigned int fixedSteps; // Run this many FIXED_TICKTIME steps and exit, 0 for normal timekeeping
+	unsigned int stepCount;
+	sf::Clock clockRun;
+	
+	// Hardware counters, only with --perf
+	bool perfEnabled;
+	z::PhaseCounters* counters;
+	unsigned int perfSteps; // Since the counters were last reset
+	std::string perfText;
+	SpinLock perfTextLock;
+	
+	// Live metrics, only with --metrics
+	unsigned int metricsPort;
+	z::StepMetrics* metrics;
+	z::MetricsServer* metricsServer;
 	
 	// Threads
 	std::thread* drawThread;
-	std::thread* calcPhysicsThread1;
-	std::thread* calcPhysicsThread2;
+	std::vector<std::thread*> physicsThreads;
+	
+	z::TaskExecutor* executor;
+	z::TaskGraph sortGraph; // Step that trickles particles through the tree
+	z::TaskGraph rebuildGraph; // Step that rebuilds the tree from scratch
+	z::SpinningBarrier* stepEnd;
+	z::SpinningBarrier* stepStart;
 	
-	z::SpinningBarrier rendezvous1 = z::SpinningBarrier(2);
-	z::SpinningBarrier rendezvous2 = z::SpinningBarrier(2);
-	z::SpinningBarrier rendezvous3 = z::SpinningBarrier(2);
-			
-	std::atomic<int>* loadBalance1 = new std::atomic<int>;
-	std::atomic<int>* loadBalance2 = new std::atomic<int>;
-	std::atomic<int>* loadBalance3 = new std::atomic<int>;
-	std::atomic<bool>* finishFlag1 = new std::atomic<bool>;
-	std::atomic<bool>* finishFlag2 = new std::atomic<bool>;
-	std::atomic<bool>* finishFlag3 = new std::atomic<bool>;
 	std::atomic<bool>* threadsPaused = new std::atomic<bool>;
+	std::atomic<int>* threadsParked = new std::atomic<int>; // Physics threads waiting out a pause
 
 	///////////////////
 	// GUI Functions //
 	///////////////////
 	
+	// Settings go through the command queue like any other edit
+	void sendSetting(CommandType type, bool flag) {
+		Command cmd(type);
+		cmd.flag = flag;
+		particles->commands.push(cmd);
+	}
 	void buttonCollision() {
-		particles->particleCollisions = cbCollision->IsActive();
+		sendSetting(CMD_SET_COLLISIONS, cbCollision->IsActive());
 	}
 	void buttonStickyness() {
-		particles->particleStickyness = cbStickyness->IsActive();
+		sendSetting(CMD_SET_STICKYNESS, cbStickyness->IsActive());
 	}
 	void buttonGravity() {
-		particles->linGravity = (cbGravity->IsActive())?DEFAULT_LIN_GRAV:0.0;
+		Command cmd(CMD_SET_GRAVITY);
+		cmd.vel = (cbGravity->IsActive())?DEFAULT_LIN_GRAV:0.0;
+		particles->commands.push(cmd);
 	}
 	void buttonBoundCeiling() {
-		particles->boundCeiling = cbBoundCeiling->IsActive();
+		sendSetting(CMD_SET_BOUND_CEILING, cbBoundCeiling->IsActive());
 	}
 	void buttonBoundFloor() {
-		particles->boundFloor = cbBoundFloor->IsActive();
+		sendSetting(CMD_SET_BOUND_FLOOR, cbBoundFloor->IsActive());
 	}
 	void buttonBoundWalls() {
-		particles->boundWalls = cbBoundWalls->IsActive();
+		sendSetting(CMD_SET_BOUND_WALLS, cbBoundWalls->IsActive());
+	}
+	void buttonQuadRebuild() {
+		if (fixedSteps > 0) cbQuadRebuild->SetActive(true); // Trickling depends on thread timing
+		else sendSetting(CMD_SET_QUAD_REBUILD, cbQuadRebuild->IsActive());
+	}
+	void buttonSleeping() {
+		sendSetting(CMD_SET_SLEEPING, cbSleeping->IsActive());
+	}
+	void buttonBHField() {
+		sendSetting(CMD_SET_BH_FIELD, cbBHField->IsActive());
 	}
 	void buttonDebug() {
-		for (unsigned int i = 0; i < particles->pSize; i++) {
-			std::cout << "Particle " << particles->ballV[i]->id << ": ";
-			if (particles->ballV[i]->alive) {
-				std::cout << "Vel = " << sqrt(pow(particles->ballV[i]->xVel, 2.0) + pow(particles->ballV[i]->yVel, 2.0));
-				std::cout <<", x = " << particles->ballV[i]->x << ", y = " << particles->ballV[i]->y << "\n\tLevel: ";
-				std::cout << particles->ballV[i]->quadResidence->level << ", ChildNum: " << particles->ballV[i]->quadResidence->childNum;
-				std::cout	<< ", xMin, xMax, yMin, yMax: " << particles->ballV[i]->quadResidence->xMin << "," << particles->ballV[i]->quadResidence->xMax << "," << particles->ballV[i]->quadResidence->yMin << "," << particles->ballV[i]->quadResidence->yMax << "\n";
-				particles->ballV[i]->updateBounds();
-				std::cout << "\t\t\txMin, xMax, yMin, yMax: " << particles->ballV[i]->xMin << "\t" << particles->ballV[i]->xMax << "\t" << particles->ballV[i]->yMin << "\t" << particles->ballV[i]->yMax << "\n";
-				std::cout << "\t\tBall points to Quad Residence: " << ((particles->ballV[i]->quadResidence->checkIfResident(particles->ballV[i]->id, false))?"True":"False") << "\n";
-			}
-			else {
-				std::cout << "Inactive\n";
-			}
-		}
-		std::cout << "\n";
-		particles->quadTree->printParams();
-		std::cout << "\n";
+		input->send(CMD_PRINT_PARTICLES);
 	}
 	void buttonPause() {
 		if (bPause->IsActive()) {
@@ -164,16 +189,18 @@ private:
 		}
 		else {
 			*threadsPaused = false;
-			pauseCV1.notify_one();
-			pauseCV2.notify_one();
+			pauseCV.notify_all();
 			bPause->SetLabel("Pause Sim");
 		}
 	}
 	void buttonClear() {
-		particles->clearParticles();
+		input->send(CMD_CLEAR);
+	}
+	void buttonClearWalls() {
+		input->send(CMD_CLEAR_WALLS);
 	}
 	void buttonStop() {
-		particles->zeroVel();
+		input->send(CMD_ZERO_VEL);
 	}
 	void buttonMouseSelect() {
 		if(mouseFuncErase->IsActive()) input->mouseMode = 1;
@@ -182,6 +209,7 @@ private:
 		else if(mouseFuncShoot->IsActive()) input->mouseMode = 4;
 		else if(mouseFuncPlaceBH->IsActive()) input->mouseMode = 5;
 		else if(mouseFuncControlBH->IsActive()) input->mouseMode = 6;
+		else if(mouseFuncWall->IsActive()) input->mouseMode = 7;
 		input->modeChanged = true;
 	}
 	void buttonShootSelect() {
@@ -192,12 +220,14 @@ private:
 	void buttonPermanence() {
 		input->bhPermanent = bhPermCheckButton->IsActive();
 		if (input->bhPermanent) {
-			particles->bhV[0].active = true;
-			particles->bhV[0].xMove = resX/2.0;
-			particles->bhV[0].yMove = resY/2.0;
+			Command cmd(CMD_MOVE_BH0);
+			cmd.x = resX/2.0;
+			cmd.y = resY/2.0;
+			cmd.flag = true; // Also activate
+			particles->commands.push(cmd);
 		}
 		else {
-			particles->bhV[0].active = false;
+			input->send(CMD_HIDE_BH0);
 		}
 	}
 	void buttonEraseFunc() {
@@ -223,6 +253,10 @@ private:
 		else input->paintForce = false;
 		mouseFuncPaint->SetActive(true);
 	}
+	void buttonPaintFixed() {
+		input->paintFixed = paintFixedCheckButton->IsActive();
+		mouseFuncPaint->SetActive(true);
+	}
 	void scaleTimeAdj() {
 		scaleFactorM = scaleAdjustment->GetValue();
 	}
@@ -283,10 +317,14 @@ private:
 		cbBoundCeiling->SetActive(particles->boundCeiling);
 		cbBoundWalls->SetActive(particles->boundWalls);
 		cbBoundFloor->SetActive(particles->boundFloor);
+		cbQuadRebuild->SetActive(particles->quadRebuild);
+		cbSleeping->SetActive(particles->particleSleeping);
+		cbBHField->SetActive(particles->bhFieldCache);
 
 		bhPermCheckButton->SetActive(input->bhPermanent);
 		paintOvrCheckButton->SetActive(input->paintOvr);
 		paintForceCheckButton->SetActive(input->paintForce);
+		paintFixedCheckButton->SetActive(input->paintFixed);
 		
 		scaleAdjustment->SetValue(1.0);
 	}
@@ -339,6 +377,15 @@ private:
 		cbBoundFloor = sfg::CheckButton::Create("Floor");
 		cbBoundFloor->GetSignal(sfg::ToggleButton::OnToggle).Connect(std::bind(&z::Simulation::buttonBoundFloor, this));
 		
+		cbQuadRebuild = sfg::CheckButton::Create("Rebuild Tree");
+		cbQuadRebuild->GetSignal(sfg::ToggleButton::OnToggle).Connect(std::bind(&z::Simulation::buttonQuadRebuild, this));
+		
+		cbSleeping = sfg::CheckButton::Create("Sleeping");
+		cbSleeping->GetSignal(sfg::ToggleButton::OnToggle).Connect(std::bind(&z::Simulation::buttonSleeping, this));
+		
+		cbBHField = sfg::CheckButton::Create("Cache Blackholes");
+		cbBHField->GetSignal(sfg::ToggleButton::OnToggle).Connect(std::bind(&z::Simulation::buttonBHField, this));
+		
 		bPause = sfg::ToggleButton::Create("Pause Sim");
 		bPause->GetSignal(sfg::Widget::OnLeftClick).Connect(std::bind(&z::Simulation::buttonPause, this));
 		
@@ -348,6 +395,9 @@ private:
 		bClear = sfg::Button::Create("Clear Screen");
 		bClear->GetSignal(sfg::Widget::OnLeftClick).Connect(std::bind(&z::Simulation::buttonClear, this));
 		
+		bClearWalls = sfg::Button::Create("Clear Walls");
+		bClearWalls->GetSignal(sfg::Widget::OnLeftClick).Connect(std::bind(&z::Simulation::buttonClearWalls, this));
+		
 		bStop = sfg::Button::Create("Zero Velocities");
 		bStop->GetSignal( sfg::Widget::OnLeftClick).Connect(std::bind(&z::Simulation::buttonStop, this));
 
@@ -368,6 +418,7 @@ private:
 		mouseFuncShoot = sfg::RadioButton::Create("Shoot Particles", mouseFuncErase->GetGroup());
 		mouseFuncPlaceBH = sfg::RadioButton::Create("Place Blackhole", mouseFuncErase->GetGroup());
 		mouseFuncControlBH = sfg::RadioButton::Create("Control Blackhole", mouseFuncErase->GetGroup());
+		mouseFuncWall = sfg::RadioButton::Create("Draw Walls", mouseFuncErase->GetGroup());
 		mouseFuncErase->SetActive(true);
 		mouseFuncErase->GetSignal(sfg::ToggleButton::OnToggle).Connect(std::bind(&z::Simulation::buttonMouseSelect, this));
 		mouseFuncDrag->GetSignal(sfg::ToggleButton::OnToggle).Connect(std::bind(&z::Simulation::buttonMouseSelect, this));
@@ -375,12 +426,14 @@ private:
 		mouseFuncShoot->GetSignal(sfg::ToggleButton::OnToggle).Connect(std::bind(&z::Simulation::buttonMouseSelect, this));
 		mouseFuncPlaceBH->GetSignal(sfg::ToggleButton::OnToggle).Connect(std::bind(&z::Simulation::buttonMouseSelect, this));
 		mouseFuncControlBH->GetSignal(sfg::ToggleButton::OnToggle).Connect(std::bind(&z::Simulation::buttonMouseSelect, this));
+		mouseFuncWall->GetSignal(sfg::ToggleButton::OnToggle).Connect(std::bind(&z::Simulation::buttonMouseSelect, this));
 		mouseFuncErase->SetId("MajorCheck");
 		mouseFuncDrag->SetId("MajorCheck");
 		mouseFuncPaint->SetId("MajorCheck");
 		mouseFuncShoot->SetId("MajorCheck");
 		mouseFuncPlaceBH->SetId("MajorCheck");
 		mouseFuncControlBH->SetId("MajorCheck");
+		mouseFuncWall->SetId("MajorCheck");
 		
 		shootFuncClick = sfg::RadioButton::Create("Single Click");
 		shootFuncDrag = sfg::RadioButton::Create("Click & Drag", shootFuncClick->GetGroup());
@@ -398,6 +451,8 @@ private:
 		paintOvrCheckButton->GetSignal(sfg::ToggleButton::OnToggle).Connect(std::bind(&z::Simulation::buttonPaintOvr, this));
 		paintForceCheckButton = sfg::CheckButton::Create("Forced Paint");
 		paintForceCheckButton->GetSignal(sfg::ToggleButton::OnToggle).Connect(std::bind(&z::Simulation::buttonPaintForce, this));
+		paintFixedCheckButton = sfg::CheckButton::Create("Fixed in Place");
+		paintFixedCheckButton->GetSignal(sfg::ToggleButton::OnToggle).Connect(std::bind(&z::Simulation::buttonPaintFixed, this));
 		
 		densityCombo = sfg::ComboBox::Create();
 		densityCombo->AppendItem("Low Density");
@@ -416,6 +471,7 @@ private:
 		auto fixed1 = sfg::Fixed::Create();
 		fixed1->Put(paintOvrCheckButton, sf::Vector2f(10.0, 0.0));
 		fixed1->Put(paintForceCheckButton, sf::Vector2f(10.0, 20.0));
+		fixed1->Put(paintFixedCheckButton, sf::Vector2f(10.0, 40.0));
 		
 		auto fixed2 = sfg::Fixed::Create();
 		fixed2->Put(shootFuncClick, sf::Vector2f(10.0, 0.0));
@@ -438,7 +494,7 @@ private:
 		
 		auto instructions = sfg::Label::Create();
 		instructions->SetLineWrap(false);
-		instructions->SetText("Use the scroll wheel\nalong with CTRL or\nSHIFT to modify mouse\nfunctions.");
+		instructions->SetText("Use the scroll wheel\nalong with CTRL or\nSHIFT to modify mouse\nfunctions.\n\nHold SHIFT while\ndrawing walls to click\nthe corners of an\noutline.");
 		
 		boxSim->Pack(bPause);
 		boxSim->Pack(label3);
@@ -446,6 +502,7 @@ private:
 		boxSim->Pack(label4);
 		boxSim->Pack(scaleScale);
 		boxSim->Pack(bClear);
+		boxSim->Pack(bClearWalls);
 		boxSim->Pack(bStop);
 		boxSim->Pack(bDebug);
 		
@@ -456,6 +513,9 @@ private:
 		boxParam->Pack(cbBoundCeiling);
 		boxParam->Pack(cbBoundWalls);
 		boxParam->Pack(cbBoundFloor);
+		boxParam->Pack(cbQuadRebuild);
+		boxParam->Pack(cbSleeping);
+		boxParam->Pack(cbBHField);
 				
 		boxParticles->Pack(fixed6, false, true);
 		boxParticles->Pack(diameterCombo);
@@ -472,6 +532,7 @@ private:
 		boxMouse->Pack(mouseFuncPlaceBH);
 		boxMouse->Pack(mouseFuncControlBH);
 		boxMouse->Pack(fixed3, false, true);
+		boxMouse->Pack(mouseFuncWall);
 		
 		boxMain->Pack(boxSim, false, true);
 		boxMain->Pack(separatorh1, false, true);
@@ -501,8 +562,17 @@ public:
 	
 	z::Particles *particles;
 	
-	Simulation() {
-		srand(static_cast<unsigned>(time(0)));
+	// The same seed and a nonzero step count give the same run every time
+	Simulation(unsigned long seedIn, unsigned int fixedStepsIn, bool perfIn, unsigned int metricsPortIn) {
+		seed = seedIn;
+		fixedSteps = fixedStepsIn;
+		stepCount = 0;
+		perfEnabled = perfIn;
+		counters = NULL;
+		perfSteps = 0;
+		metricsPort = metricsPortIn;
+		metrics = NULL;
+		metricsServer = NULL;
 		loadParams();
 	}
 
@@ -510,14 +580,17 @@ public:
 		// Clean up
 		delete mainWindow;
 		delete drawThread;
-		delete calcPhysicsThread1;
-		delete calcPhysicsThread2;
+		for (unsigned int w = 0; w < physicsThreads.size(); w++) delete physicsThreads[w];
+		delete metricsServer;
+		delete executor;
+		delete counters;
+		delete metrics;
+		delete stepEnd;
+		delete stepStart;
 		delete particles;
 		delete input;
-		delete loadBalance1;
-		delete loadBalance2;
-		delete finishFlag1;
-		delete finishFlag2;
+		delete threadsPaused;
+		delete threadsParked;
 	}
 	
 	void loadParams() {
@@ -526,6 +599,7 @@ public:
 		resY = DEFAULT_RES_Y;
 		
 		particles = new Particles(&resX, &resY, &tickTime, DEFAULT_LIN_GRAV);
+		particles->rng.seed(seed);
 		input = new z::Input(particles);
 																			
 		input->newBallDia = DIA_SMALL;
@@ -536,6 +610,10 @@ public:
 		particles->boundCeiling = true;
 		particles->boundWalls = true;
 		particles->boundFloor = true;
+		// A rebuilt tree lists residents in the same order however the workers were scheduled
+		particles->quadRebuild = (fixedSteps > 0);
+		particles->particleSleeping = true;
+		particles->bhFieldCache = true;
 		
 		particles->createInitBalls(DEFAULT_NUM_BALLS, DIA_SMALL, DENSITY_MED);
 		
@@ -637,23 +715,37 @@ public:
 	}
 		
 	void launch() {
-		running = true;
-		*threadsPaused = false;
-		drawThread = new std::thread(&Simulation::draw, this);
-		calcPhysicsThread1 = new std::thread(&Simulation::calcPhysics1, this);
+		unsigned int numWorkers = 1;
 		if (MULTITHREAD) {
-			calcPhysicsThread2 = new std::thread(&Simulation::calcPhysics2, this);
-			*loadBalance1 = particles->pSize / 2.0;
-			*loadBalance2 = particles->pSize / 2.0;
-			*loadBalance3 = particles->pSize / 2.0;
+			// Leave a core for drawing
+			unsigned int cores = std::thread::hardware_concurrency();
+			numWorkers = (cores > 3) ? cores - 1 : 2;
 		}
-		else {
-			*loadBalance1 = 0;
-			*loadBalance2 = 0;
-			*loadBalance3 = 0;
+		executor = new z::TaskExecutor(numWorkers);
+		particles->setWorkers(numWorkers);
+		if (perfEnabled) {
+			counters = new z::PhaseCounters(numWorkers, stepPhaseNames());
+			executor->setCounters(counters);
 		}
+		if (metricsPort > 0) {
+			metrics = new z::StepMetrics(numWorkers, stepPhaseNames());
+			executor->setMetrics(metrics);
+			metricsServer = new z::MetricsServer(metrics, metricsPort);
+		}
+		particles->buildStepGraph(sortGraph, false);
+		particles->buildStepGraph(rebuildGraph, true);
+		executor->prepare(particles->quadRebuild ? &rebuildGraph : &sortGraph);
+		stepEnd = new z::SpinningBarrier(numWorkers);
+		stepStart = new z::SpinningBarrier(numWorkers);
+		
+		running = true;
+		stepRunning = true;
+		stepPaused = false;
+		stealsPerStep = 0;
+		*threadsPaused = false;
+		*threadsParked = 0;
 		
-		tickTime = 0.002; // Jump start to avoid physics glitches
+		tickTime = (fixedSteps > 0) ? FIXED_TICKTIME : 0.002; // Jump start to avoid physics glitches
 		tickTimeActual = tickTime;
 		tickTimeMax = MAX_TICKTIME;
 		frameRateP = 500;
@@ -662,10 +754,32 @@ public:
 		
 		clockD.restart();
 		clockP.restart();
+		clockRun.restart();
+		
+		drawThread = new std::thread(&Simulation::draw, this);
+		for (unsigned int w = 0; w < numWorkers; w++) {
+			physicsThreads.push_back(new std::thread(&Simulation::calcPhysics, this, w));
+		}
 						
 		drawThread->join();
-		calcPhysicsThread1->join();
-		if (MULTITHREAD) calcPhysicsThread2->join();
+		for (unsigned int w = 0; w < numWorkers; w++) physicsThreads[w]->join();
+		
+		if (fixedSteps > 0) report();
+	}
+	
+	// Timing and a checksum of the final state, for comparing runs
+	void report() {
+		double checksum = 0;
+		for (unsigned int i = 0; i < particles->pSize; i++) {
+			Ball *ball = particles->ballV[i];
+			if (ball->alive) checksum += ball->x + ball->y*3.0 + ball->xVel*5.0 + ball->yVel*7.0;
+		}
+		double seconds = clockRun.getElapsedTime().asSeconds();
+		std::cout << "seed " << seed << ", " << stepCount << " steps, " << particles->ballAlive << " particles\n";
+		std::cout << "time " << seconds << " s, " << 1000.0*seconds/std::max(stepCount, 1u) << " ms/step\n";
+		std::cout.precision(17);
+		std::cout << "checksum " << checksum << "\n";
+		if (counters != NULL) std::cout << counters->format(perfSteps);
 	}
 	
 	/////////////
@@ -683,6 +797,12 @@ public:
 		sf::Event event;
 				
 		while (mainWindow->isOpen()) {
+			
+			// Fixed step runs end on their own
+			if (!running) {
+				mainWindow->close();
+				break;
+			}
 				
 			elapsedTimeD = clockD.restart();
 			frameRateD = 0.05*(1.0/elapsedTimeD.asSeconds()) + frameRateD*(1.0 - 0.05);
@@ -695,8 +815,7 @@ public:
 						mainWindow->close();
 						running = false;
 						*threadsPaused = false;
-						pauseCV1.notify_one();
-						pauseCV2.notify_one();
+						pauseCV.notify_all();
 						break;
 					case sf::Event::LostFocus:
 						input->windowFocused = false;
@@ -720,6 +839,13 @@ public:
 									
 			input->update();
 			
+			// Physics can't drain edits while paused, so apply them here once every worker is parked
+			// and build the frame showing them, since no step will
+			if (*threadsPaused && *threadsParked == (int)executor->size() && particles->applyCommands()) {
+				if (particles->maintenanceDue()) particles->maintainParticles();
+				particles->emitFrame();
+			}
+			
 			scaleBar->SetFraction(scaleFactor);
 			guiWindow->Update(1.0);
 			
@@ -731,13 +857,22 @@ public:
 						
 			// Draw text/gui
 			if (debugRead) {
+				const FrameStats &shown = particles->render.front().stats; // Taken with the frame, workers don't touch it
 				std::string temp = std::to_string(scaleFactor);
 				temp.resize(4);
-				fps.setString(std::to_string((int)frameRateP) + "," + temp + "," + std::to_string((int)frameRateD) + "\n" + 
-											std::to_string(*loadBalance1) + "," + std::to_string(*loadBalance2) + "," + std::to_string(*loadBalance3)
-											+ "\n" + std::to_string(particles->pSize) + "," + std::to_string(particles->ballAlive)
-											+ "\n" + std::to_string(particles->bhV.size()) + "," + std::to_string(particles->bhAlive)
-											+ "\n" + std::to_string((int)particles->maxParticleVel));
+				std::string hud = std::to_string((int)frameRateP) + "," + temp + "," + std::to_string((int)frameRateD) + "\n" + 
+											std::to_string(executor->size()) + "," + std::to_string(stealsPerStep)
+											+ "\n" + std::to_string(shown.particles) + "," + std::to_string(shown.alive) + "," + std::to_string(shown.sleeping)
+											+ "\n" + std::to_string(shown.blackholes) + "," + std::to_string(shown.bhAlive)
+											+ "\n" + std::to_string((int)shown.maxVel)
+											+ "\n" + std::to_string(shown.contacts) + "," + std::to_string((long)shown.kineticEnergy)
+											+ "," + std::to_string((long)shown.momentum);
+				if (counters != NULL) {
+					perfTextLock.lock();
+					hud += "\n" + perfText;
+					perfTextLock.unlock();
+				}
+				fps.setString(hud);
 				mainWindow->draw(fps);
 			}
 						
@@ -748,117 +883,100 @@ public:
 		}
 	}
 		
-	// Handle first portion of particles
-	void calcPhysics1() {
-		std::unique_lock<std::mutex> lock1(pauseMutex1);
-				
-		if (MULTITHREAD) {
-			while(running){
-				if (*threadsPaused) {
-					pauseCV1.wait(lock1);
-					clockP.restart();
-				}
-				
-				*finishFlag1 = false;
-				particles->quadSortParticles(0, *loadBalance1);
-				*finishFlag1 = true;
-				
-				rendezvous1.wait();
-				
-				*finishFlag2 = false;
-				particles->quadCollideParticles(0, *loadBalance2);
-				*finishFlag2 = true;
-								
-				rendezvous2.wait();
-				
-				*finishFlag3 = false;
-				particles->addPhysics(0, *loadBalance3);
-				particles->cleanQuad();
-				
-				{ // Timekeeping
-					elapsedTimeP = clockP.restart();
-					
-					tickTimeActual = TICKTIME_AVGFILT*elapsedTimeP.asSeconds() + tickTimeActual*(1.0 - TICKTIME_AVGFILT);
-					tickTimeMax = std::min(Ball::diameterTable[DIA_SMALL]/(2.0*particles->maxParticleVel), MAX_TICKTIME);
-					
-					double tempScaleFactor =  std::min(tickTimeMax/tickTimeActual, scaleFactorM);
-					if (scaleFactor > tempScaleFactor) scaleFactor = tempScaleFactor;
-					else scaleFactor = SCALEFACT_AVGFILT*tickTimeActual*std::min(tickTimeMax/tickTimeActual, scaleFactorM)
-														 + scaleFactor*(1.0 - tickTimeActual*SCALEFACT_AVGFILT);
-					
-					tickTime = tickTimeActual*scaleFactor;
-					
-					frameRateP = 1.0/tickTimeActual;
+	// Every worker runs the step's task graph, then worker 0 alone handles the step boundary
+	void calcPhysics(unsigned int worker) {
+		if (counters != NULL) counters->attach(worker);
+		
+		while (stepRunning) {
+			executor->run(worker);
+			
+			waitTimed(stepEnd, worker);
+			if (worker == 0) {
+				uint64_t start = (metrics != NULL) ? z::metricsNow() : 0;
+				if (counters != NULL) counters->begin(worker);
+				finishStep();
+				if (metrics != NULL) metrics->task(worker, PHASE_BOUNDARY, z::metricsNow() - start);
+				if (counters != NULL) {
+					counters->end(worker, PHASE_BOUNDARY);
+					reportCounters();
 				}
-					
-				*finishFlag3 = true;
-				
-				rendezvous3.wait();
 			}
-		}
-		else {
-			while(running){
-				if (*threadsPaused) {
-					pauseCV1.wait(lock1);
-					clockP.restart();
-				}
+			waitTimed(stepStart, worker);
 			
-				particles->quadSortParticles(0, particles->pSize);
-				particles->quadCollideParticles(0, particles->pSize);
-				particles->cleanQuad();
-				particles->addPhysics(0, particles->pSize);
-				
-				{ // Timekeeping
-					elapsedTimeP = clockP.restart();
-					
-					tickTimeActual = TICKTIME_AVGFILT*elapsedTimeP.asSeconds() + tickTimeActual*(1.0 - TICKTIME_AVGFILT);
-					tickTimeMax = std::min(DIA_SMALL/(2.0*particles->maxParticleVel), MAX_TICKTIME);
-					
-					double tempScaleFactor =  std::min(tickTimeMax/tickTimeActual, scaleFactorM);
-					if (scaleFactor > tempScaleFactor) scaleFactor = tempScaleFactor;
-					else scaleFactor = SCALEFACT_AVGFILT*tickTimeActual*std::min(tickTimeMax/tickTimeActual, scaleFactorM)
-														 + scaleFactor*(1.0 - tickTimeActual*SCALEFACT_AVGFILT);
-					
-					tickTime = tickTimeActual*scaleFactor;
-					
-					frameRateP = 1.0/tickTimeActual;
-				}
+			if (stepPaused) {
+				std::unique_lock<std::mutex> lock(pauseMutex);
+				(*threadsParked)++;
+				while (*threadsPaused) pauseCV.wait_for(lock, std::chrono::milliseconds(10));
+				(*threadsParked)--;
+				if (worker == 0) clockP.restart();
 			}
 		}
 	}
 	
-	// Handle second portion of particles
-	void calcPhysics2() {
-		std::unique_lock<std::mutex> lock2(pauseMutex2);
-		while(running){
-			if (*threadsPaused) {
-				pauseCV2.wait(lock2);
-			}
+	void waitTimed(z::SpinningBarrier *barrier, unsigned int worker) {
+		if (metrics == NULL) {
+			barrier->wait();
+			return;
+		}
+		uint64_t start = z::metricsNow();
+		barrier->wait();
+		metrics->barrier(worker, z::metricsNow() - start);
+	}
+	
+	// Refresh the HUD's counter text every PERF_REPORT_STEPS steps
+	// Fixed step runs keep counting so the final report covers the whole run
+	void reportCounters() {
+		perfSteps++;
+		if (perfSteps%PERF_REPORT_STEPS != 0) return;
+		std::string text = counters->format(perfSteps);
+		perfTextLock.lock();
+		perfText = text;
+		perfTextLock.unlock();
+		if (fixedSteps == 0) {
+			counters->reset();
+			perfSteps = 0;
+		}
+	}
+	
+	// Runs between steps while the other workers wait
+	void finishStep() {
+		particles->moveBH();
+		particles->collectStats();
 		
-			particles->quadSortParticles(*loadBalance1, particles->pSize);
-			if (*finishFlag1 == true) {
-				 if (*loadBalance1 < particles->pSize - 1) *loadBalance1 = *loadBalance1 + 1;
-			}
-			else if (*loadBalance1 > 0) *loadBalance1 = *loadBalance1 - 1;
+		{ // Timekeeping
+			elapsedTimeP = clockP.restart();
 			
-			rendezvous1.wait();
+			tickTimeActual = TICKTIME_AVGFILT*elapsedTimeP.asSeconds() + tickTimeActual*(1.0 - TICKTIME_AVGFILT);
+			tickTimeMax = std::min(Ball::diameterTable[DIA_SMALL]/(2.0*particles->maxParticleVel), MAX_TICKTIME);
 			
-			particles->quadCollideParticles(*loadBalance2, particles->pSize);
-			if (*finishFlag2 == true) {
-				 if (*loadBalance2 < particles->pSize - 1) *loadBalance2 = *loadBalance2 + 1;
-			}
-			else if (*loadBalance2 > 0) *loadBalance2 = *loadBalance2 - 1;
-
-			rendezvous2.wait();
+			double tempScaleFactor =  std::min(tickTimeMax/tickTimeActual, scaleFactorM);
+			if (scaleFactor > tempScaleFactor) scaleFactor = tempScaleFactor;
+			else scaleFactor = SCALEFACT_AVGFILT*tickTimeActual*std::min(tickTimeMax/tickTimeActual, scaleFactorM)
+												 + scaleFactor*(1.0 - tickTimeActual*SCALEFACT_AVGFILT);
+			
+			tickTime = tickTimeActual*scaleFactor;
+			
+			frameRateP = 1.0/tickTimeActual;
 			
-			particles->addPhysics(*loadBalance3, particles->pSize);
-			if (*finishFlag3 == true) {
-				 if (*loadBalance3 < particles->pSize - 1) *loadBalance3 = *loadBalance3 + 1;
+			// Wall clock still feeds the display, but never the step
+			if (fixedSteps > 0) {
+				tickTime = FIXED_TICKTIME;
+				if (++stepCount >= fixedSteps) running = false;
 			}
-			else if (*loadBalance3 > 0) *loadBalance3 = *loadBalance3 - 1;
-						
-			rendezvous3.wait();
 		}
+		
+		particles->applyCommands();
+		if (particles->maintenanceDue()) particles->maintainParticles();
+		particles->publishFrame();
+		
+		executor->prepare(particles->quadRebuild ? &rebuildGraph : &sortGraph);
+		stealsPerStep = executor->takeSteals();
+		if (metrics != NULL) {
+			metrics->step(elapsedTimeP.asMicroseconds()*1000, frameRateP, stealsPerStep, particles->pSize, particles->ballAlive,
+										particles->bhV.size(), particles->bhAlive);
+		}
+		stepRunning = running;
+		stepPaused = *threadsPaused;
 	}
 
 };
@@ -1,3 +1,6 @@
+#ifndef SPINLOCK_HPP
+#define SPINLOCK_HPP
+
 #include <atomic>
 
 namespace z {
@@ -14,4 +17,6 @@ public:
 	}
 };
 
-}
\ No newline at end of file
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,187 @@
+#ifndef TASK_GRAPH_HPP
+#define TASK_GRAPH_HPP
+
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <functional>
+#include <thread>
+
+#include "spinlock.hpp"
+#include "perfCounters.hpp"
+#include "metrics.hpp"
+
+namespace z {
+
+// Tasks of one physics step and what each has to wait for
+// Built once and run every step
+class TaskGraph {
+public:
+	struct Task {
+		std::function<void(unsigned int)> run; // Passed the number of the worker running it
+		std::vector<unsigned int> successors;
+		int dependencies;
+		unsigned int phase; // Which PhaseCounters total its hardware counts go to
+	};
+
+	std::vector<Task> tasks;
+
+	unsigned int addTask(std::function<void(unsigned int)> run, unsigned int phase = 0) {
+		Task task;
+		task.run = run;
+		task.dependencies = 0;
+		task.phase = phase;
+		tasks.push_back(task);
+		return tasks.size() - 1;
+	}
+
+	// Task after won't start until task before has finished
+	void addDependency(unsigned int before, unsigned int after) {
+		tasks[before].successors.push_back(after);
+		tasks[after].dependencies++;
+	}
+};
+
+// Runs a TaskGraph on a fixed set of workers
+// Each worker has its own deque; it takes its newest task first and,
+// when it runs dry, steals the oldest task from another worker
+class TaskExecutor {
+private:
+	struct Worker {
+		std::deque<unsigned int> queue;
+		SpinLock queueLock;
+		char pad[64]; // Keep neighbouring workers' locks off the same cache line
+	};
+
+	std::vector<Worker*> workers;
+	TaskGraph *graph;
+	std::atomic<int> *pending; // Unfinished dependencies per task
+	unsigned int pendingSize;
+	std::atomic<int> remaining; // Unfinished tasks
+	std::atomic<unsigned int> steals;
+	PhaseCounters *counters; // Optional, counts every task
+	StepMetrics *metrics; // Optional, times every task
+
+	void push(unsigned int worker, unsigned int task) {
+		workers[worker]->queueLock.lock();
+		workers[worker]->queue.push_back(task);
+		workers[worker]->queueLock.unlock();
+	}
+
+	bool take(unsigned int worker, unsigned int &task) {
+		bool found = false;
+		workers[worker]->queueLock.lock();
+		if (!workers[worker]->queue.empty()) {
+			task = workers[worker]->queue.back();
+			workers[worker]->queue.pop_back();
+			found = true;
+		}
+		workers[worker]->queueLock.unlock();
+		return found;
+	}
+
+	bool steal(unsigned int worker, unsigned int &task) {
+		for (unsigned int k = 1; k < workers.size(); k++) {
+			Worker *victim = workers[(worker + k)%workers.size()];
+			bool found = false;
+			victim->queueLock.lock();
+			if (!victim->queue.empty()) {
+				task = victim->queue.front();
+				victim->queue.pop_front();
+				found = true;
+			}
+			victim->queueLock.unlock();
+			if (found) {
+				steals++;
+				return true;
+			}
+		}
+		return false;
+	}
+
+public:
+	TaskExecutor(unsigned int numWorkers) {
+		for (unsigned int w = 0; w < numWorkers; w++) workers.push_back(new Worker);
+		graph = NULL;
+		pending = NULL;
+		pendingSize = 0;
+		remaining = 0;
+		steals = 0;
+		counters = NULL;
+		metrics = NULL;
+	}
+	~TaskExecutor() {
+		for (unsigned int w = 0; w < workers.size(); w++) delete workers[w];
+		delete[] pending;
+	}
+
+	unsigned int size() {
+		return workers.size();
+	}
+	
+	// Each worker must also attach to the counters from its own thread
+	void setCounters(PhaseCounters *countersIn) {
+		counters = countersIn;
+	}
+	
+	void setMetrics(StepMetrics *metricsIn) {
+		metrics = metricsIn;
+	}
+
+	// Set up the next run
+	// Call from one thread while no worker is inside run()
+	void prepare(TaskGraph *nextGraph) {
+		graph = nextGraph;
+		unsigned int numTasks = graph->tasks.size();
+		if (numTasks > pendingSize) {
+			delete[] pending;
+			pending = new std::atomic<int>[numTasks];
+			pendingSize = numTasks;
+		}
+		unsigned int nextWorker = 0;
+		for (unsigned int t = 0; t < numTasks; t++) {
+			pending[t] = graph->tasks[t].dependencies;
+			if (graph->tasks[t].dependencies == 0) {
+				workers[nextWorker]->queue.push_back(t);
+				nextWorker = (nextWorker + 1)%workers.size();
+			}
+		}
+		remaining = numTasks;
+	}
+
+	// Call from every worker, returns once the whole graph has run
+	void run(unsigned int worker) {
+		unsigned int task;
+		uint64_t entered = (metrics != NULL) ? metricsNow() : 0;
+		uint64_t busy = 0;
+		while (remaining > 0) {
+			if (take(worker, task) || steal(worker, task)) {
+				TaskGraph::Task &current = graph->tasks[task];
+				uint64_t start = (metrics != NULL) ? metricsNow() : 0;
+				if (counters != NULL) counters->begin(worker);
+				current.run(worker);
+				if (counters != NULL) counters->end(worker, current.phase);
+				if (metrics != NULL) {
+					uint64_t ns = metricsNow() - start;
+					metrics->task(worker, current.phase, ns);
+					busy += ns;
+				}
+				for (unsigned int s = 0; s < current.successors.size(); s++) {
+					if (--pending[current.successors[s]] == 0) push(worker, current.successors[s]);
+				}
+				remaining--;
+			}
+			else std::this_thread::yield();
+		}
+		if (metrics != NULL) metrics->idle(worker, metricsNow() - entered - busy);
+	}
+
+	// Tasks stolen since the last call
+	unsigned int takeSteals() {
+		return steals.exchange(0);
+	}
+};
+
+}
+
+#endif